@@ -17,12 +17,22 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA 
  *----------------------------------------------------------------------*/
 
+/* Enables posix_memalign() and madvise() */
+#define _DEFAULT_SOURCE
+
 #define PROGNAME "yuvadjust"
 #define VERSION "1.0"
 #define COPYRIGHT "Copyright 2005 Johannes Lehtinen"
 
 #define DEFAULT_BUFFER_SIZE 30
 
+/* Fixed-point scale of the moving averages passed to adjust_frame() */
+#define EMA_SCALE 256
+
+/* Alignment of planes in the frame arena and of large arenas */
+#define ARENA_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 #define VERBOSE_DEBUG 2
 
 #define OPER_LCONTRAST 1
@@ -34,42 +44,132 @@
 #define MIN_UV 16
 #define MAX_UV 240
 
+/* Statistics file magic and the length of its header */
+#define STATS_MAGIC "YUVADJ1\n"
+#define STATS_HEADER_LENGTH 24
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_SIMD 1
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <getopt.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <yuv4mpeg.h>
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 static int oper = 0;
 static int only_half = 0;
+static int two_pass = 0;
+static double ema_frames = 0;
+static double percentile = -1;
 static y4m_stream_info_t stream_info;
 static int plane_count;
 static int plane_width[Y4M_MAX_NUM_PLANES];
 static int plane_height[Y4M_MAX_NUM_PLANES];
 static int plane_length[Y4M_MAX_NUM_PLANES];
 static uint8_t *(*planes)[Y4M_MAX_NUM_PLANES];
+static uint8_t *frame_arena;
 static y4m_frame_info_t *input_frame_infos;
 static int (*favg)[Y4M_MAX_NUM_PLANES];
+static int favg_size;
+static const char *stats_out_name = NULL;
+static const char *stats_in_name = NULL;
+static FILE *stats_out = NULL;
+static uint8_t (*stats_avg)[3] = NULL;
+static int stats_frame_count = 0;
 static int avg_sum[Y4M_MAX_NUM_PLANES];
+static uint32_t (*fhist)[256] = NULL;
+static uint64_t hist_sum[256];
 static int buffer_count = 0;
 static int buffer_head = 0;
 static int buffer_tail = 0;
 static int buffer_size = DEFAULT_BUFFER_SIZE;
+static int buffer_slots;
 static int buffer_pos = 0;
+static int consumed_frame_count = 0;
+static int thread_count = 1;
 static int verbose = 0;
 static int clip = 0;
 static int input_frame_count = 0;
 static int output_frame_count = 0;
+static uint8_t plane_table[3][256];
+static int table_key[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+static int table_active[3];
+static unsigned long (*sum_kernel)(const uint8_t *p, int length);
+static void (*lookup_kernel)(uint8_t *p, int length, const uint8_t *table);
+static const char *kernel_name;
+static pthread_t *workers;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_slot = -1;
+static int pool_generation = 0;
+static int pool_pending = 0;
+static pthread_t reader;
+static pthread_t writer;
+static pthread_mutex_t pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t input_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
+static int input_read = 0;
+static int input_eof = 0;
+static int window_released = 0;
+static int output_queued = 0;
+static int output_written = 0;
+static int output_done = 0;
 
 static void parse_options(int argc, char *argv[]);
+static void alloc_frame_arena(int slots);
 static int read_frame(void);
+static int read_input(int slot);
+static int wait_input(void);
 static void step_buffer(void);
-static void analyze_buffered_frame(int i);
+static void write_output(int slot);
+static void start_pipeline(void);
+static void stop_pipeline(void);
+static void *input_reader(void *arg);
+static void *output_writer(void *arg);
+static void analyze_frame(uint8_t *const frame_planes[], int frame_avg[], uint32_t *frame_hist);
 static void adjust_frame(int i);
+static void find_percentiles(int *low, int *high);
+static void apply_stripe(int i, int stripe);
+static long stripe_bound(long length, int stripe);
+static void start_workers(void);
+static void stop_workers(void);
+static void *adjust_worker(void *arg);
+static void process_two_pass(off_t data_start);
+static void process_causal(void);
+static int read_frame_avgs(void);
+static void open_stats_out(void);
+static void write_stats_header(int frame_count);
+static void store_frame_avg(const int frame_avg[]);
+static void close_stats_out(void);
+static void load_stats(void);
+static void load_frame_avg(int frame_avg[]);
+static void check_stats_count(void);
+static void put_u32(uint8_t *b, uint32_t v);
+static uint32_t get_u32(const uint8_t *b);
+static void select_kernels(void);
+static unsigned long sum_plane_c(const uint8_t *p, int length);
+static void histogram_plane(const uint8_t *p, int length, uint32_t *hist);
+static void lookup_plane_c(uint8_t *p, int length, const uint8_t *table);
+#ifdef HAVE_X86_SIMD
+static unsigned long sum_plane_sse2(const uint8_t *p, int length);
+static unsigned long sum_plane_avx2(const uint8_t *p, int length);
+static void lookup_plane_ssse3(uint8_t *p, int length, const uint8_t *table);
+static void lookup_plane_avx2(uint8_t *p, int length, const uint8_t *table);
+#endif
 
 int main(int argc, char *argv[]) {
+	off_t data_start = 0;
+	int slots;
 	int i;
 
 	/* Read options */
@@ -86,6 +186,21 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 
+	/* Open the statistics files */
+	if (stats_in_name != NULL) {
+		load_stats();
+	}
+	if (stats_out_name != NULL) {
+		open_stats_out();
+	}
+	
+	/* Two passes require rewinding the input unless averages were loaded */
+	if (two_pass && stats_in_name == NULL
+		&& (data_start = lseek(STDIN_FILENO, 0, SEEK_CUR)) == -1) {
+		fputs(PROGNAME ": error: two-pass mode requires seekable input\n", stderr);
+		exit(1);
+	}
+
 	/* Print input information if verbose */
 	if (verbose) {
 		const char *chrstr;
@@ -95,16 +210,44 @@ int main(int argc, char *argv[]) {
 			(chrstr != NULL ? chrstr : "unsupported"));
 	}
 
-	/* Allocate space for buffers */
-	planes = malloc(sizeof(uint8_t *[Y4M_MAX_NUM_PLANES]) * buffer_size);
-	input_frame_infos = malloc(sizeof(y4m_frame_info_t) * buffer_size);
-	favg = malloc(sizeof(int [Y4M_MAX_NUM_PLANES]) * buffer_size);
+	/* Select the processing kernels supported by the CPU */
+	select_kernels();
+	if (verbose & VERBOSE_DEBUG) {
+		fprintf(stderr, PROGNAME ": debug: using %s kernels\n", kernel_name);
+	}
+
+	/*
+	 * Allocate space for buffers. In two-pass and causal modes only a single
+	 * frame is buffered. Two-pass mode keeps the averages of all frames. The
+	 * pipelined mode needs room for a frame being read and one being
+	 * written in addition to the window.
+	 */
+	if (two_pass || ema_frames > 0) {
+		slots = 1;
+	} else if (thread_count > 1) {
+		slots = buffer_size + 2;
+	} else {
+		slots = buffer_size;
+	}
+	buffer_slots = slots;
+	if (percentile >= 0) {
+		fhist = malloc(sizeof(uint32_t [256]) * slots);
+		if (fhist == NULL) {
+			fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+			exit(1);
+		}
+		memset(hist_sum, 0, sizeof(hist_sum));
+	}
+	favg_size = slots;
+	planes = malloc(sizeof(uint8_t *[Y4M_MAX_NUM_PLANES]) * slots);
+	input_frame_infos = malloc(sizeof(y4m_frame_info_t) * slots);
+	favg = malloc(sizeof(int [Y4M_MAX_NUM_PLANES]) * favg_size);
 	if (planes == NULL || input_frame_infos == NULL
 		|| favg == NULL /*|| yvcount == NULL*/) {
 		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
 		exit(1);
 	}
-	for (i = 0; i < buffer_size; i++) {
+	for (i = 0; i < slots; i++) {
 		y4m_init_frame_info(input_frame_infos + i);
 	}
 	plane_count = y4m_si_get_plane_count(&stream_info);
@@ -113,8 +256,6 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 	for (i = 0; i < plane_count; i++) {
-		int j;
-		
 		plane_width[i] = y4m_si_get_plane_width(&stream_info, i);
 		plane_height[i] = y4m_si_get_plane_height(&stream_info, i);
 		plane_length[i] = y4m_si_get_plane_length(&stream_info, i);
@@ -122,15 +263,9 @@ int main(int argc, char *argv[]) {
 			fputs(PROGNAME ": error: unsupported chroma mode\n", stderr);
 			exit(1);
 		}
-		for (j = 0; j < buffer_size; j++) {
-			(planes[j])[i] = malloc(plane_length[i]);
-			if ((planes[j])[i] == NULL) {
-				fputs(PROGNAME ": error: memory allocation failed\n", stderr);
-				exit(1);
-			}
-		}
 		avg_sum[i] = 0;
 	}
+	alloc_frame_arena(slots);
 	
 	/* Write output stream header */
 	if (y4m_write_stream_header(STDOUT_FILENO, &stream_info) != Y4M_OK) {
@@ -139,35 +274,61 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 	
+	/* Analyze and adjust in separate passes if requested */
+	start_workers();
+	if (two_pass) {
+		process_two_pass(data_start);
+		stop_workers();
+		close_stats_out();
+		return 0;
+	}
+	
+	/* Adjust each frame immediately in causal mode */
+	if (ema_frames > 0) {
+		process_causal();
+		stop_workers();
+		close_stats_out();
+		return 0;
+	}
+	
 	/* Buffer some frames */
+	start_pipeline();
 	for (i = 0; i < (buffer_size + 1) / 2; i++) {
 		if (!read_frame()) {
 			break;
 		}
 	}
 	
-	/* Process frame by frame and send out */
-	while (buffer_pos != buffer_head) {
+	/*
+	 * Process frame by frame and send out. Counting the pending frames
+	 * rather than comparing ring positions also works when the read ahead
+	 * frames fill the whole ring, as with a buffer of a single frame.
+	 */
+	while (output_frame_count < consumed_frame_count) {
 		adjust_frame(buffer_pos);
-		if (y4m_write_frame(STDOUT_FILENO, &stream_info,
-			input_frame_infos + buffer_pos,
-			planes[buffer_pos]) != Y4M_OK) {
-			fputs(PROGNAME ": error: could not write output stream\n",
-				stderr);
-			exit(1);
+		if (thread_count > 1) {
+			pthread_mutex_lock(&pipe_mutex);
+			output_queued++;
+			pthread_cond_broadcast(&output_cond);
+			pthread_mutex_unlock(&pipe_mutex);
+		} else {
+			write_output(buffer_pos);
 		}
 		if (verbose & VERBOSE_DEBUG) {
 			fprintf(stderr, PROGNAME ": debug: produced output frame %u\n",
 				output_frame_count);
 		}
 		output_frame_count++;
-		if (++buffer_pos >= buffer_size) {
+		if (++buffer_pos >= buffer_slots) {
 			buffer_pos = 0;
 		}
 		if (!read_frame()) {
 			step_buffer();
 		}
 	}
+	stop_pipeline();
+	stop_workers();
+	close_stats_out();
 	
 	return 0;
 }
@@ -176,7 +337,7 @@ static void parse_options(int argc, char *argv[]) {
 	int c;
 
 	/* Read options */	
-	while ((c = getopt(argc, argv, "b:cdhHlvwW")) != -1) {
+	while ((c = getopt(argc, argv, "a:A:b:cde:hHlp:st:vwW")) != -1) {
 		switch (c) {
 			case 'h':
 				fputs(
@@ -204,12 +365,29 @@ COPYRIGHT "\n"
 "  -h       print this help text and exit\n"
 "  -b NUM   use information from up to NUM surrounding frames to adjust\n"
 "             a frame (default is 30 frames)\n"
+"  -e NUM   adjust each frame immediately using moving averages of the\n"
+"             preceding frames with a time constant of NUM frames\n"
 "  -H       adjust only the first half of each frame (for comparison)\n"
+"  -p PCT   stretch luminance contrast linearly so that PCT percent of the\n"
+"             surrounding samples fall below nominal black and above\n"
+"             nominal white (modifies -l)\n"
 "  -c       clip output YUV values to their nominal ranges (exclude headroom)\n"
+"  -s       analyze seekable input in a separate first pass, buffering only\n"
+"             a single frame\n"
+"  -a FILE  write per-frame statistics to FILE for later runs\n"
+"  -A FILE  use per-frame statistics from FILE instead of analyzing frames\n"
+"  -t N     adjust frames using N threads, reading and analyzing ahead and\n"
+"             writing in separate threads (default is 1, no extra threads)\n"
 "  -v       verbose operation\n"
 "  -d       enable debug output\n",
 					stdout);
 				exit(0);
+			case 'a':
+				stats_out_name = optarg;
+				break;
+			case 'A':
+				stats_in_name = optarg;
+				break;
 			case 'b':
 				buffer_size = atoi(optarg);
 				if (buffer_size <= 0) {
@@ -223,12 +401,38 @@ COPYRIGHT "\n"
 			case 'd':
 				verbose |= VERBOSE_DEBUG;
 				break;
+			case 'e':
+				ema_frames = atof(optarg);
+				if (ema_frames < 1) {
+					fputs(PROGNAME ": error: illegal time constant\n", stderr);
+					exit(1);
+				}
+				break;
 			case 'H':
 				only_half = 1;
 				break;
 			case 'l':
 				oper |= OPER_LCONTRAST;
 				break;
+			case 'p':
+				percentile = atof(optarg);
+				if (percentile < 0 || percentile >= 50) {
+					fputs(PROGNAME ": error: illegal percentile\n", stderr);
+					exit(1);
+				}
+				break;
+			case 's':
+				two_pass = 1;
+				break;
+			case 't':
+				thread_count = atoi(optarg);
+				if (thread_count <= 0) {
+					fprintf(stderr,
+						PROGNAME ": error: invalid number of threads %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
 			case 'v':
 				verbose |= 1;
 				break;
@@ -258,6 +462,30 @@ COPYRIGHT "\n"
 		fputs(PROGNAME ": warning: color contrast enhancement will also adjust white balance\n", stderr);
 		oper &= ~(OPER_WHITEBALANCE);
 	}
+	
+	/* Causal mode does not look ahead */
+	if (ema_frames > 0 && two_pass) {
+		fputs(PROGNAME ": error: options -e and -s are mutually exclusive\n", stderr);
+		exit(1);
+	}
+	
+	/* Percentile contrast needs the histograms of the surrounding frames */
+	if (percentile >= 0) {
+		if (!(oper & OPER_LCONTRAST)) {
+			fputs(PROGNAME ": error: option -p requires -l\n", stderr);
+			exit(1);
+		}
+		if (two_pass || ema_frames > 0 || stats_in_name != NULL) {
+			fputs(PROGNAME ": error: option -p conflicts with -s, -e and -A\n", stderr);
+			exit(1);
+		}
+	}
+	
+	/* Loaded statistics would only be copied */
+	if (stats_out_name != NULL && stats_in_name != NULL) {
+		fputs(PROGNAME ": error: options -a and -A are mutually exclusive\n", stderr);
+		exit(1);
+	}
 
 	/* Print configuration if verbose */
 	if (verbose) {
@@ -267,11 +495,20 @@ COPYRIGHT "\n"
 		if (oper & OPER_LCONTRAST) {
 			fputs(PROGNAME ": conf: adjust luminance level and contrast\n", stderr);
 		}
+		if (percentile >= 0) {
+			fprintf(stderr, PROGNAME ": conf: stretch luminance to %.3f%% percentiles\n",
+				percentile);
+		}
 		if (oper & OPER_CCONTRAST) {
 			fputs(PROGNAME ": conf: adjust white balance and color contrast\n", stderr);
 		}
-		fprintf(stderr, PROGNAME ": conf: buffer size %u frames\n",
-			buffer_size);
+		if (ema_frames > 0) {
+			fprintf(stderr, PROGNAME ": conf: moving average time constant %.3f frames\n",
+				ema_frames);
+		} else {
+			fprintf(stderr, PROGNAME ": conf: buffer size %u frames\n",
+				buffer_size);
+		}
 		if (only_half) {
 			fputs(PROGNAME ": conf: adjust only the first half of each frame\n",
 				stderr);
@@ -280,100 +517,666 @@ COPYRIGHT "\n"
 			fputs(PROGNAME ": conf: clip output YUV values to their nominal range\n",
 				stderr);
 		}
+		if (two_pass) {
+			fputs(PROGNAME ": conf: analyze and adjust in two passes\n",
+				stderr);
+		}
+		if (thread_count > 1) {
+			fprintf(stderr, PROGNAME ": conf: %u adjusting threads\n",
+				thread_count);
+		}
+		if (stats_out_name != NULL) {
+			fprintf(stderr, PROGNAME ": conf: write statistics to %s\n",
+				stats_out_name);
+		}
+		if (stats_in_name != NULL) {
+			fprintf(stderr, PROGNAME ": conf: read statistics from %s\n",
+				stats_in_name);
+		}
+	}
+}
+
+/*
+ * Allocates the frame buffers from a single arena. Each plane starts at an
+ * ARENA_ALIGNMENT boundary. Arenas larger than a huge page are aligned to
+ * huge pages and advised to be backed by them where supported.
+ */
+static void alloc_frame_arena(int slots) {
+	size_t offset[Y4M_MAX_NUM_PLANES];
+	size_t stride = 0;
+	size_t size;
+	size_t alignment;
+	int i, j;
+	
+	for (i = 0; i < plane_count; i++) {
+		offset[i] = stride;
+		stride += (plane_length[i] + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+	}
+	size = stride * slots;
+	alignment = (size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : ARENA_ALIGNMENT);
+	if (posix_memalign((void **) &frame_arena, alignment, size) != 0) {
+		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+		exit(1);
+	}
+#ifdef MADV_HUGEPAGE
+	if (alignment == HUGE_PAGE_SIZE) {
+		madvise(frame_arena, size, MADV_HUGEPAGE);
+	}
+#endif
+	for (j = 0; j < slots; j++) {
+		for (i = 0; i < plane_count; i++) {
+			(planes[j])[i] = frame_arena + j * stride + offset[i];
+		}
+	}
+	if (verbose) {
+		fprintf(stderr, PROGNAME ": conf: frame arena of %lu bytes for %u frames\n",
+			(unsigned long) size, slots);
 	}
 }
 
+/*
+ * Moves the next input frame into the window, stepping the window first if
+ * it is full. Returns 0 at the end of the input stream.
+ */
 static int read_frame(void) {
 	int i;
 	
 	if (buffer_count >= buffer_size) {
 		step_buffer();
 	}
-	if ((i = y4m_read_frame(STDIN_FILENO, &stream_info,
-		input_frame_infos + buffer_head, planes[buffer_head]))
-		== Y4M_OK) {
-		
+	if (thread_count > 1 ? wait_input() : read_input(buffer_head)) {
 		buffer_count++;
 		if (verbose & VERBOSE_DEBUG) {
 			fprintf(stderr, PROGNAME
 				": debug: consumed input frame %u (%u frames buffered)\n",
-				input_frame_count, buffer_count);
+				consumed_frame_count, buffer_count);
 		}
-		analyze_buffered_frame(buffer_head);
 		for (i = 0; i < plane_count; i++) {
 			avg_sum[i] += (favg[buffer_head])[i];
 		}
-		if (++buffer_head >= buffer_size) {
+		if (fhist != NULL) {
+			for (i = 0; i < 256; i++) {
+				hist_sum[i] += (fhist[buffer_head])[i];
+			}
+		}
+		if (++buffer_head >= buffer_slots) {
 			buffer_head = 0;
 		}
+		consumed_frame_count++;
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+/*
+ * Reads the next input frame into the specified slot and analyzes it.
+ * Returns 0 at the end of the input stream.
+ */
+static int read_input(int slot) {
+	int i;
+	
+	if ((i = y4m_read_frame(STDIN_FILENO, &stream_info,
+		input_frame_infos + slot, planes[slot])) == Y4M_OK) {
+		if (stats_avg != NULL) {
+			load_frame_avg(favg[slot]);
+		} else {
+			analyze_frame(planes[slot], favg[slot],
+				fhist != NULL ? fhist[slot] : NULL);
+		}
+		store_frame_avg(favg[slot]);
 		input_frame_count++;
 		return 1;
 	} else if (i != Y4M_ERR_EOF) {
 		fputs(PROGNAME ": error: could not read input stream\n", stderr);
 		exit(1);
 	} else {
+		check_stats_count();
 		return 0;
 	}
 }
 
+/* Waits for the reader thread to provide the next frame */
+static int wait_input(void) {
+	int more;
+	
+	pthread_mutex_lock(&pipe_mutex);
+	while (input_read == consumed_frame_count && !input_eof) {
+		pthread_cond_wait(&input_cond, &pipe_mutex);
+	}
+	more = (input_read > consumed_frame_count);
+	pthread_mutex_unlock(&pipe_mutex);
+	return more;
+}
+
 static void step_buffer(void) {
 	int i;
 
 	for (i = 0; i < plane_count; i++) {
 		avg_sum[i] -= (favg[buffer_tail])[i];
 	}
-	if (++buffer_tail >= buffer_size) {
+	if (fhist != NULL) {
+		for (i = 0; i < 256; i++) {
+			hist_sum[i] -= (fhist[buffer_tail])[i];
+		}
+	}
+	if (++buffer_tail >= buffer_slots) {
 		buffer_tail = 0;
 	}
 	buffer_count--;	
+	if (thread_count > 1) {
+		pthread_mutex_lock(&pipe_mutex);
+		window_released++;
+		pthread_cond_broadcast(&input_cond);
+		pthread_mutex_unlock(&pipe_mutex);
+	}
 }
 
-static void analyze_buffered_frame(int i) {
-	int j, k;
-	uint8_t *p;
+static void write_output(int slot) {
+	if (y4m_write_frame(STDOUT_FILENO, &stream_info,
+		input_frame_infos + slot, planes[slot]) != Y4M_OK) {
+		fputs(PROGNAME ": error: could not write output stream\n",
+			stderr);
+		exit(1);
+	}
+}
+
+/*
+ * Starts the reader and writer threads of the pipelined mode. A slot can
+ * be refilled by the reader once its frame has been written and has left
+ * the averaging window.
+ */
+static void start_pipeline(void) {
+	if (thread_count <= 1) {
+		return;
+	}
+	if (pthread_create(&reader, NULL, input_reader, NULL) != 0
+		|| pthread_create(&writer, NULL, output_writer, NULL) != 0) {
+		fputs(PROGNAME ": error: could not create a pipeline thread\n", stderr);
+		exit(1);
+	}
+}
+
+/* Waits for the writer to write out the queued frames */
+static void stop_pipeline(void) {
+	if (thread_count <= 1) {
+		return;
+	}
+	pthread_mutex_lock(&pipe_mutex);
+	output_done = 1;
+	pthread_cond_broadcast(&output_cond);
+	pthread_mutex_unlock(&pipe_mutex);
+	pthread_join(writer, NULL);
+	pthread_join(reader, NULL);
+}
+
+static void *input_reader(void *arg) {
+	int slot = 0;
+	int more;
+	
+	(void) arg;
+	do {
+		pthread_mutex_lock(&pipe_mutex);
+		while (input_read - buffer_slots >= window_released
+			|| input_read - buffer_slots >= output_written) {
+			pthread_cond_wait(&input_cond, &pipe_mutex);
+		}
+		pthread_mutex_unlock(&pipe_mutex);
+		more = read_input(slot);
+		pthread_mutex_lock(&pipe_mutex);
+		if (more) {
+			if (++slot >= buffer_slots) {
+				slot = 0;
+			}
+			input_read++;
+		} else {
+			input_eof = 1;
+		}
+		pthread_cond_broadcast(&input_cond);
+		pthread_mutex_unlock(&pipe_mutex);
+	} while (more);
+	return NULL;
+}
+
+static void *output_writer(void *arg) {
+	int slot = 0;
+	
+	(void) arg;
+	pthread_mutex_lock(&pipe_mutex);
+	while (1) {
+		if (output_written < output_queued) {
+			pthread_mutex_unlock(&pipe_mutex);
+			write_output(slot);
+			if (++slot >= buffer_slots) {
+				slot = 0;
+			}
+			pthread_mutex_lock(&pipe_mutex);
+			output_written++;
+			pthread_cond_broadcast(&input_cond);
+		} else if (output_done) {
+			break;
+		} else {
+			pthread_cond_wait(&output_cond, &pipe_mutex);
+		}
+	}
+	pthread_mutex_unlock(&pipe_mutex);
+	return NULL;
+}
+
+/*
+ * Processes the whole input in two passes. The first pass stores the
+ * averages of each frame and the second pass rewinds the input and adjusts
+ * the frames one at a time, sliding the averaging window exactly like the
+ * buffered mode does.
+ */
+static void process_two_pass(off_t data_start) {
+	int frame_count;
+	int lo = 0;
+	int hi = 0;
+	int pos;
+	int i;
+	
+	/* First pass: analyze, unless the averages were loaded */
+	if (stats_avg != NULL) {
+		frame_count = stats_frame_count;
+		favg = realloc(favg, sizeof(int [Y4M_MAX_NUM_PLANES]) * (frame_count + 1));
+		if (favg == NULL) {
+			fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+			exit(1);
+		}
+		for (pos = 0; pos < frame_count; pos++) {
+			load_frame_avg(favg[pos]);
+			input_frame_count++;
+		}
+	} else {
+		frame_count = read_frame_avgs();
+		if (verbose & VERBOSE_DEBUG) {
+			fprintf(stderr, PROGNAME ": debug: analyzed %u frames\n", frame_count);
+		}
+		if (lseek(STDIN_FILENO, data_start, SEEK_SET) == -1) {
+			fputs(PROGNAME ": error: could not rewind input stream\n", stderr);
+			exit(1);
+		}
+	}
+	
+	/* Second pass: adjust using a window of frame averages */
+	for (i = 0; i < plane_count; i++) {
+		avg_sum[i] = 0;
+	}
+	while (hi < frame_count && hi < (buffer_size + 1) / 2) {
+		for (i = 0; i < plane_count; i++) {
+			avg_sum[i] += (favg[hi])[i];
+		}
+		hi++;
+	}
+	for (pos = 0; pos < frame_count; pos++) {
+		int steps = 0;
+		
+		buffer_count = hi - lo;
+		if ((i = y4m_read_frame(STDIN_FILENO, &stream_info,
+			input_frame_infos, planes[0])) != Y4M_OK) {
+			if (i == Y4M_ERR_EOF && stats_avg != NULL) {
+				check_stats_count();
+			}
+			fputs(PROGNAME ": error: could not re-read input stream\n", stderr);
+			exit(1);
+		}
+		adjust_frame(0);
+		if (y4m_write_frame(STDOUT_FILENO, &stream_info,
+			input_frame_infos, planes[0]) != Y4M_OK) {
+			fputs(PROGNAME ": error: could not write output stream\n",
+				stderr);
+			exit(1);
+		}
+		if (verbose & VERBOSE_DEBUG) {
+			fprintf(stderr, PROGNAME ": debug: produced output frame %u\n",
+				output_frame_count);
+		}
+		output_frame_count++;
+		
+		/* Slide the window as read_frame() and step_buffer() would */
+		if (hi - lo >= buffer_size) {
+			steps++;
+		}
+		if (hi < frame_count) {
+			for (i = 0; i < plane_count; i++) {
+				avg_sum[i] += (favg[hi])[i];
+			}
+			hi++;
+		} else {
+			steps++;
+		}
+		for (; steps > 0; steps--) {
+			for (i = 0; i < plane_count; i++) {
+				avg_sum[i] -= (favg[lo])[i];
+			}
+			lo++;
+		}
+	}
+	
+	/* Loaded statistics must cover the whole input */
+	if (stats_avg != NULL
+		&& y4m_read_frame(STDIN_FILENO, &stream_info, input_frame_infos,
+			planes[0]) != Y4M_ERR_EOF) {
+		fputs(PROGNAME ": error: statistics file does not match input stream\n", stderr);
+		exit(1);
+	}
+}
+
+/*
+ * Processes the input in causal mode. Each frame is adjusted as soon as it
+ * has been read, using exponential moving averages of the frames so far.
+ * The averages are passed to adjust_frame() as fixed-point window sums
+ * over EMA_SCALE frames, so the adjustment tables are rebuilt only when a
+ * quantized average changes.
+ */
+static void process_causal(void) {
+	double ema[3];
+	int i;
+	
+	buffer_count = EMA_SCALE;
+	while (read_input(0)) {
+		for (i = 0; i < 3; i++) {
+			if (input_frame_count == 1) {
+				ema[i] = (favg[0])[i];
+			} else {
+				ema[i] += ((favg[0])[i] - ema[i]) / ema_frames;
+			}
+			avg_sum[i] = (int) floor(ema[i] * EMA_SCALE + 0.5);
+		}
+		adjust_frame(0);
+		write_output(0);
+		if (verbose & VERBOSE_DEBUG) {
+			fprintf(stderr, PROGNAME ": debug: produced output frame %u\n",
+				output_frame_count);
+		}
+		output_frame_count++;
+	}
+}
+
+/*
+ * Reads the rest of the input stream into the first frame buffer and stores
+ * the average values of each frame. Returns the number of frames read.
+ */
+static int read_frame_avgs(void) {
+	int i;
+	
+	while ((i = y4m_read_frame(STDIN_FILENO, &stream_info,
+		input_frame_infos, planes[0])) == Y4M_OK) {
+		if (input_frame_count >= favg_size) {
+			favg_size *= 2;
+			favg = realloc(favg, sizeof(int [Y4M_MAX_NUM_PLANES]) * favg_size);
+			if (favg == NULL) {
+				fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+				exit(1);
+			}
+		}
+		analyze_frame(planes[0], favg[input_frame_count], NULL);
+		store_frame_avg(favg[input_frame_count]);
+		input_frame_count++;
+	}
+	if (i != Y4M_ERR_EOF) {
+		fputs(PROGNAME ": error: could not read input stream\n", stderr);
+		exit(1);
+	}
+	return input_frame_count;
+}
 
+/*
+ * Calculates the plane averages used by the selected operations. The
+ * averages of unused planes are set to zero, so that window sums and the
+ * causal mode moving averages never read uninitialized values. If a
+ * histogram is requested, the luma samples are counted into it and the luma
+ * average is derived from the counts, so that luma is scanned only once.
+ */
+static void analyze_frame(uint8_t *const frame_planes[], int frame_avg[], uint32_t *frame_hist) {
+	int j;
+
+	if (frame_hist != NULL) {
+		histogram_plane(frame_planes[0], plane_length[0], frame_hist);
+	}
 	for (j = 0; j <= 2; j++) {
-		unsigned long sum = 0;
-			
-		if ((j == 0 && (oper & OPER_LCONTRAST))
+		if (stats_out != NULL
+			|| (j == 0 && (oper & OPER_LCONTRAST))
 			|| (j > 0 && (oper & (OPER_WHITEBALANCE | OPER_CCONTRAST)))) {
-			p = (planes[i])[j];
-			for (k = plane_length[j]; k; k--) {
-				sum += *p;
-				p++;
+			unsigned long sum = 0;
+			int v;
+			
+			if (j == 0 && frame_hist != NULL) {
+				for (v = 1; v < 256; v++) {
+					sum += (unsigned long) v * frame_hist[v];
+				}
+			} else {
+				sum = sum_kernel(frame_planes[j], plane_length[j]);
 			}
-			(favg[i])[j] = (sum + plane_length[j] / 2) / plane_length[j];
+			frame_avg[j] = (sum + plane_length[j] / 2) / plane_length[j];
 			if (verbose & VERBOSE_DEBUG) {
 				if (oper & OPER_WHITEBALANCE) {
 					fprintf(stderr, PROGNAME ": debug: input frame %u avg(%c) = %u\n",
-						input_frame_count, (j == 0 ? 'y' : (j == 1 ? 'u' : 'v')), (int) (favg[i])[j]);
+						input_frame_count, (j == 0 ? 'y' : (j == 1 ? 'u' : 'v')), frame_avg[j]);
 				}
 			}
+		} else {
+			frame_avg[j] = 0;
 		}
 	}
 }
 
+/*
+ * Opens the statistics output file and writes a preliminary header. The
+ * statistics file starts with STATS_MAGIC followed by the frame width,
+ * height, chroma mode and frame count as 32-bit little-endian integers.
+ * The Y, U and V averages of each frame follow, one byte each.
+ */
+static void open_stats_out(void) {
+	if ((stats_out = fopen(stats_out_name, "wb")) == NULL) {
+		fprintf(stderr, PROGNAME ": error: could not open statistics file %s\n",
+			stats_out_name);
+		exit(1);
+	}
+	write_stats_header(0);
+}
+
+/* Writes the statistics file header for the specified number of frames */
+static void write_stats_header(int frame_count) {
+	uint8_t header[STATS_HEADER_LENGTH];
+	
+	memcpy(header, STATS_MAGIC, 8);
+	put_u32(header + 8, y4m_si_get_width(&stream_info));
+	put_u32(header + 12, y4m_si_get_height(&stream_info));
+	put_u32(header + 16, y4m_si_get_chroma(&stream_info));
+	put_u32(header + 20, frame_count);
+	if (fwrite(header, STATS_HEADER_LENGTH, 1, stats_out) != 1) {
+		fputs(PROGNAME ": error: could not write statistics file\n", stderr);
+		exit(1);
+	}
+}
+
+/* Appends the averages of the next frame to the statistics file */
+static void store_frame_avg(const int frame_avg[]) {
+	uint8_t b[3];
+	int j;
+	
+	if (stats_out == NULL) {
+		return;
+	}
+	for (j = 0; j < 3; j++) {
+		b[j] = frame_avg[j];
+	}
+	if (fwrite(b, 3, 1, stats_out) != 1) {
+		fputs(PROGNAME ": error: could not write statistics file\n", stderr);
+		exit(1);
+	}
+}
+
+/* Completes the statistics file header with the frame count and closes it */
+static void close_stats_out(void) {
+	if (stats_out == NULL) {
+		return;
+	}
+	if (fseek(stats_out, 0, SEEK_SET) != 0) {
+		fputs(PROGNAME ": error: statistics file is not seekable\n", stderr);
+		exit(1);
+	}
+	write_stats_header(input_frame_count);
+	if (fclose(stats_out) != 0) {
+		fputs(PROGNAME ": error: could not write statistics file\n", stderr);
+		exit(1);
+	}
+	stats_out = NULL;
+}
+
+/*
+ * Reads the averages of all frames from the statistics input file after
+ * checking that it was written for a stream of the same geometry.
+ */
+static void load_stats(void) {
+	uint8_t header[STATS_HEADER_LENGTH];
+	FILE *f;
+	
+	if ((f = fopen(stats_in_name, "rb")) == NULL) {
+		fprintf(stderr, PROGNAME ": error: could not open statistics file %s\n",
+			stats_in_name);
+		exit(1);
+	}
+	if (fread(header, STATS_HEADER_LENGTH, 1, f) != 1
+		|| memcmp(header, STATS_MAGIC, 8)) {
+		fputs(PROGNAME ": error: invalid statistics file\n", stderr);
+		exit(1);
+	}
+	if (get_u32(header + 8) != (uint32_t) y4m_si_get_width(&stream_info)
+		|| get_u32(header + 12) != (uint32_t) y4m_si_get_height(&stream_info)
+		|| get_u32(header + 16) != (uint32_t) y4m_si_get_chroma(&stream_info)) {
+		fputs(PROGNAME ": error: statistics file does not match input stream\n", stderr);
+		exit(1);
+	}
+	stats_frame_count = get_u32(header + 20);
+	if (stats_frame_count < 0) {
+		fputs(PROGNAME ": error: invalid statistics file\n", stderr);
+		exit(1);
+	}
+	stats_avg = malloc(sizeof(uint8_t [3]) * (stats_frame_count + 1));
+	if (stats_avg == NULL) {
+		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+		exit(1);
+	}
+	if (fread(stats_avg, 3, stats_frame_count, f) != (size_t) stats_frame_count) {
+		fputs(PROGNAME ": error: could not read statistics file\n", stderr);
+		exit(1);
+	}
+	fclose(f);
+	if (verbose & VERBOSE_DEBUG) {
+		fprintf(stderr, PROGNAME ": debug: loaded statistics for %u frames\n",
+			stats_frame_count);
+	}
+}
+
+/* Gets the averages of the current input frame from the loaded statistics */
+static void load_frame_avg(int frame_avg[]) {
+	int j;
+	
+	if (input_frame_count >= stats_frame_count) {
+		fputs(PROGNAME ": error: statistics file does not match input stream\n", stderr);
+		exit(1);
+	}
+	for (j = 0; j < plane_count; j++) {
+		frame_avg[j] = (j < 3 ? (stats_avg[input_frame_count])[j] : 0);
+	}
+}
+
+/* Checks that the loaded statistics covered exactly the input frames */
+static void check_stats_count(void) {
+	if (stats_avg != NULL && input_frame_count != stats_frame_count) {
+		fputs(PROGNAME ": error: statistics file does not match input stream\n", stderr);
+		exit(1);
+	}
+}
+
+static void put_u32(uint8_t *b, uint32_t v) {
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+	b[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *b) {
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+/*
+ * Adjusts the planes of a buffered frame. The contrast curve, white balance
+ * offset and clipping of each plane are folded into a single lookup table
+ * which is rebuilt only when the window average changes.
+ */
 static void adjust_frame(int i) {
 	int j, k;
-	uint8_t *p;
 
-	/* Contrast enhancements */
-	for (j = 0; j <= 2; j++) {	
-		if ((j == 0 && (oper & OPER_LCONTRAST))
-			|| (j > 0 && (oper & OPER_CCONTRAST))) {
+	for (j = 0; j <= 2; j++) {
+		int contrast = ((j == 0 && (oper & OPER_LCONTRAST))
+			|| (j > 0 && (oper & OPER_CCONTRAST)));
+		int whitebalance = (j > 0 && (oper & OPER_WHITEBALANCE));
+		uint8_t *table = plane_table[j];
+		int stretch = (j == 0 && percentile >= 0);
+		int key[2];
+		int rebuild;
+		int min, max;
+		
+		table_active[j] = (contrast || whitebalance);
+		if (!table_active[j]) {
+			continue;
+		}
+		if (stretch) {
+			find_percentiles(&key[0], &key[1]);
+		} else {
+			key[0] = avg_sum[j];
+			key[1] = buffer_count;
+		}
+		rebuild = (table_key[j][0] != key[0] || table_key[j][1] != key[1]);
+		if (j == 0) {
+			min = MIN_Y;
+			max = MAX_Y;
+		} else {
+			min = MIN_UV;
+			max = MAX_UV;
+		}
+		
+		/* Contrast enhancement */
+		if (stretch) {
+			int low = key[0];
+			int high = key[1];
+			
+			if (rebuild) {
+				for (k = 0; k < 256; k++) {
+					double v = k;
+					
+					if (high > low) {
+						v = (double) (k - low) * (max - min) / (high - low) + min;
+					}
+					if (clip) {
+						if (v < min) {
+							v = min;
+						} else if (v > max) {
+							v = max;
+						}
+					} else {
+						if (v < 0) {
+							v = 0;
+						} else if (v > 255) {
+							v = 255;
+						}
+					}
+					table[k] = rint(v);
+				}
+			}
+			if (verbose & VERBOSE_DEBUG) {
+				fprintf(stderr, PROGNAME ": debug: output frame %u percentiles y %u..%u adjustment y' = (y - %u) * %.3f + %u\n",
+					output_frame_count, low, high, low,
+					(high > low ? (double) (max - min) / (high - low) : 1.0), min);
+			}
+		} else if (contrast) {
 			double avg;
 			double a, b;
-			uint8_t table[256];
-			double min;
-			double max;
 
-			if (j == 0) {
-				min = MIN_Y;
-				max = MAX_Y;
-			} else {
-				min = MIN_UV;
-				max = MAX_UV;
-			}
 			avg = ((double) avg_sum[j] / buffer_count - min) / (max - min);
 			if (avg < 0.001) {
 				avg = 0.001;
@@ -381,80 +1184,362 @@ static void adjust_frame(int i) {
 				avg = 0.999;
 			}
 			a = (0.5 - avg) / (avg * (avg - 1));
-			b = 1 - a;		
-			for (k = 0; k < 256; k++) {
-				double kn;
-				double v;
-
-				kn = ((double) k - min) / (max - min);
-				v = (a * (kn * kn) + b * kn) * (max - min) + min;
-				if (clip) {
-					if (v < min) {
-						v = min;
-					} else if (v > max) {
-						v = max;
-					}
-				} else {
-					if (v < 0) {
-						v = 0;
-					} else if (v > 255) {
-						v = 255;
+			b = 1 - a;
+			if (rebuild) {
+				for (k = 0; k < 256; k++) {
+					double kn;
+					double v;
+
+					kn = ((double) k - min) / (max - min);
+					v = (a * (kn * kn) + b * kn) * (max - min) + min;
+					if (clip) {
+						if (v < min) {
+							v = min;
+						} else if (v > max) {
+							v = max;
+						}
+					} else {
+						if (v < 0) {
+							v = 0;
+						} else if (v > 255) {
+							v = 255;
+						}
 					}
+					table[k] = rint(v);
 				}
-				table[k] = rint(v);
 			}
 			if (verbose & VERBOSE_DEBUG) {
 				char v = (j == 0 ? 'y' : (j == 1 ? 'u' : 'v'));
 				fprintf(stderr, PROGNAME ": debug: output frame %u average %c %u adjustment %c' = %.3f * %c^2 + %.3f * %c\n",
 					output_frame_count, v, avg_sum[j] / buffer_count, v, a, v, b, v);
 			}
-			p = (planes[i])[j];
-			for (k = only_half ? plane_length[j] / 2 : plane_length[j]; k; k--) {
-				*p = table[*p];
-				p++;
+		} else if (rebuild) {
+			for (k = 0; k < 256; k++) {
+				table[k] = k;
 			}
 		}
-	}
-	
-	/* Plain white balance adjustment */
-	if (oper & OPER_WHITEBALANCE) {
-		for (j = 1; j <= 2; j++) {
-			int min, max;
+		
+		/* Plain white balance adjustment */
+		if (whitebalance) {
 			int wboff;
 			
-			if (j == 0) {
-				min = MIN_Y;
-				max = MAX_Y;
-			} else {
-				min = MIN_UV;
-				max = MAX_UV;
-			}
 			wboff = -((avg_sum[j] + buffer_count / 2) / buffer_count - 128);
 			if (verbose & VERBOSE_DEBUG) {
-				if (oper & OPER_WHITEBALANCE) {
-					fprintf(stderr, PROGNAME ": debug: output frame %u white balance adjustment %c' = %c %c %u\n",
-						output_frame_count, j == 1 ? 'u' : 'v', j == 1 ? 'u' : 'v', wboff < 0 ? '-' : '+', abs(wboff));
-				}
+				fprintf(stderr, PROGNAME ": debug: output frame %u white balance adjustment %c' = %c %c %u\n",
+					output_frame_count, j == 1 ? 'u' : 'v', j == 1 ? 'u' : 'v', wboff < 0 ? '-' : '+', abs(wboff));
 			}
-			p = (planes[i])[j];
-			for (k = only_half ? plane_length[j] / 2 : plane_length[j]; k; k--) {
-				int v = *p + wboff;
-				if (clip) {
-					if (v < min) {
-						v = min;
-					} else if (v > max) {
-						v = max;
-					}
-				} else {
-					if (v < 0) {
-						v = 0;
-					} else if (v > 255) {
-						v = 255;
+			if (rebuild) {
+				for (k = 0; k < 256; k++) {
+					int v = table[k] + wboff;
+					if (clip) {
+						if (v < min) {
+							v = min;
+						} else if (v > max) {
+							v = max;
+						}
+					} else {
+						if (v < 0) {
+							v = 0;
+						} else if (v > 255) {
+							v = 255;
+						}
 					}
+					table[k] = v;
 				}
-				*p = v;
-				p++;
 			}
 		}
+		
+		table_key[j][0] = key[0];
+		table_key[j][1] = key[1];
+	}
+	
+	/* Apply the tables, split into stripes if multi-threaded */
+	if (thread_count > 1) {
+		pthread_mutex_lock(&pool_mutex);
+		pool_slot = i;
+		pool_pending = thread_count - 1;
+		pool_generation++;
+		pthread_cond_broadcast(&pool_start);
+		pthread_mutex_unlock(&pool_mutex);
+		apply_stripe(i, 0);
+		pthread_mutex_lock(&pool_mutex);
+		while (pool_pending > 0) {
+			pthread_cond_wait(&pool_done, &pool_mutex);
+		}
+		pthread_mutex_unlock(&pool_mutex);
+	} else {
+		apply_stripe(i, 0);
+	}
+}
+
+/*
+ * Finds the luminance values below and above which the configured
+ * percentage of the samples in the window histogram lie.
+ */
+static void find_percentiles(int *low, int *high) {
+	uint64_t limit;
+	uint64_t count;
+	int v;
+	
+	limit = (uint64_t) ((double) buffer_count * plane_length[0] * percentile / 100);
+	for (v = 0, count = 0; v < 255; v++) {
+		if ((count += hist_sum[v]) > limit) {
+			break;
+		}
+	}
+	*low = v;
+	for (v = 255, count = 0; v > 0; v--) {
+		if ((count += hist_sum[v]) > limit) {
+			break;
+		}
+	}
+	*high = v;
+}
+
+/*
+ * Applies the active lookup tables to the given stripe of a buffered frame.
+ * The adjusted part of each plane is split evenly into thread_count stripes.
+ */
+static void apply_stripe(int i, int stripe) {
+	int j;
+	
+	for (j = 0; j <= 2; j++) {
+		if (table_active[j]) {
+			long length = (only_half ? plane_length[j] / 2 : plane_length[j]);
+			long start = stripe_bound(length, stripe);
+			long end = stripe_bound(length, stripe + 1);
+			
+			lookup_kernel((planes[i])[j] + start, end - start, plane_table[j]);
+		}
 	}
 }
+
+/*
+ * Returns the start of the given stripe of a plane. Stripes are split at
+ * ARENA_ALIGNMENT boundaries so that threads do not share cache lines.
+ */
+static long stripe_bound(long length, int stripe) {
+	if (stripe >= thread_count) {
+		return length;
+	}
+	return (length * stripe / thread_count) & ~(long) (ARENA_ALIGNMENT - 1);
+}
+
+static void start_workers(void) {
+	int i;
+	
+	if (thread_count <= 1) {
+		return;
+	}
+	workers = malloc(sizeof(pthread_t) * (thread_count - 1));
+	if (workers == NULL) {
+		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+		exit(1);
+	}
+	for (i = 1; i < thread_count; i++) {
+		if (pthread_create(&workers[i - 1], NULL, adjust_worker, (void *) (intptr_t) i) != 0) {
+			fputs(PROGNAME ": error: could not create a worker thread\n", stderr);
+			exit(1);
+		}
+	}
+}
+
+static void stop_workers(void) {
+	int i;
+	
+	if (thread_count <= 1) {
+		return;
+	}
+	pthread_mutex_lock(&pool_mutex);
+	pool_slot = -1;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_start);
+	pthread_mutex_unlock(&pool_mutex);
+	for (i = 1; i < thread_count; i++) {
+		pthread_join(workers[i - 1], NULL);
+	}
+	free(workers);
+}
+
+static void *adjust_worker(void *arg) {
+	int stripe = (int) (intptr_t) arg;
+	int generation = 0;
+	
+	while (1) {
+		int slot;
+		
+		pthread_mutex_lock(&pool_mutex);
+		while (pool_generation == generation) {
+			pthread_cond_wait(&pool_start, &pool_mutex);
+		}
+		generation = pool_generation;
+		slot = pool_slot;
+		pthread_mutex_unlock(&pool_mutex);
+		if (slot < 0) {
+			break;
+		}
+		apply_stripe(slot, stripe);
+		pthread_mutex_lock(&pool_mutex);
+		if (--pool_pending == 0) {
+			pthread_cond_signal(&pool_done);
+		}
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	return NULL;
+}
+
+static void select_kernels(void) {
+	sum_kernel = sum_plane_c;
+	lookup_kernel = lookup_plane_c;
+	kernel_name = "scalar";
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		sum_kernel = sum_plane_avx2;
+		lookup_kernel = lookup_plane_avx2;
+		kernel_name = "AVX2";
+	} else if (__builtin_cpu_supports("ssse3")) {
+		sum_kernel = sum_plane_sse2;
+		lookup_kernel = lookup_plane_ssse3;
+		kernel_name = "SSSE3";
+	} else if (__builtin_cpu_supports("sse2")) {
+		sum_kernel = sum_plane_sse2;
+		kernel_name = "SSE2";
+	}
+#endif
+}
+
+/* Returns the sum of all sample values of a plane */
+static unsigned long sum_plane_c(const uint8_t *p, int length) {
+	unsigned long sum = 0;
+	
+	for (; length; length--) {
+		sum += *p;
+		p++;
+	}
+	return sum;
+}
+
+/*
+ * Counts the sample values of a plane. Consecutive samples are counted in
+ * separate banks so that runs of equal values do not serialize on a single
+ * counter.
+ */
+static void histogram_plane(const uint8_t *p, int length, uint32_t *hist) {
+	uint32_t bank[4][256];
+	int k, v;
+	
+	memset(bank, 0, sizeof(bank));
+	for (k = 0; k + 4 <= length; k += 4) {
+		bank[0][p[k]]++;
+		bank[1][p[k + 1]]++;
+		bank[2][p[k + 2]]++;
+		bank[3][p[k + 3]]++;
+	}
+	for (; k < length; k++) {
+		bank[0][p[k]]++;
+	}
+	for (v = 0; v < 256; v++) {
+		hist[v] = bank[0][v] + bank[1][v] + bank[2][v] + bank[3][v];
+	}
+}
+
+/* Replaces each sample value of a plane with its table entry */
+static void lookup_plane_c(uint8_t *p, int length, const uint8_t *table) {
+	for (; length; length--) {
+		*p = table[*p];
+		p++;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * The SIMD kernels sum bytes using the sum of absolute differences against
+ * zero, which adds groups of eight bytes into 64-bit lanes.
+ */
+__attribute__((target("sse2")))
+static unsigned long sum_plane_sse2(const uint8_t *p, int length) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	uint64_t lanes[2];
+	int k;
+
+	for (k = 0; k + 16 <= length; k += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + k));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+	_mm_storeu_si128((__m128i *) lanes, acc);
+	return (unsigned long) (lanes[0] + lanes[1]) + sum_plane_c(p + k, length - k);
+}
+
+__attribute__((target("avx2")))
+static unsigned long sum_plane_avx2(const uint8_t *p, int length) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	int k;
+
+	for (k = 0; k + 32 <= length; k += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (p + k));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+	}
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+	return (unsigned long) (lanes[0] + lanes[1] + lanes[2] + lanes[3])
+		+ sum_plane_sse2(p + k, length - k);
+}
+
+/*
+ * The SIMD lookup kernels split the table into sixteen 16-byte sub-tables
+ * indexed by the low nibble. For each sub-table the high nibble of matching
+ * samples is cleared by XOR and a saturating add of 0x70 sets the top bit
+ * of all other samples, which makes the byte shuffle zero them.
+ */
+__attribute__((target("ssse3")))
+static void lookup_plane_ssse3(uint8_t *p, int length, const uint8_t *table) {
+	const __m128i bias = _mm_set1_epi8(0x70);
+	__m128i sub[16];
+	int i, k;
+
+	for (i = 0; i < 16; i++) {
+		sub[i] = _mm_loadu_si128((const __m128i *) (table + 16 * i));
+	}
+	for (k = 0; k + 16 <= length; k += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + k));
+		__m128i r = _mm_setzero_si128();
+		
+		for (i = 0; i < 16; i++) {
+			__m128i idx = _mm_adds_epu8(
+				_mm_xor_si128(v, _mm_set1_epi8((char) (i << 4))), bias);
+			r = _mm_or_si128(r, _mm_shuffle_epi8(sub[i], idx));
+		}
+		_mm_storeu_si128((__m128i *) (p + k), r);
+	}
+	lookup_plane_c(p + k, length - k, table);
+}
+
+__attribute__((target("avx2")))
+static void lookup_plane_avx2(uint8_t *p, int length, const uint8_t *table) {
+	const __m256i bias = _mm256_set1_epi8(0x70);
+	__m256i sub[16];
+	int i, k;
+
+	for (i = 0; i < 16; i++) {
+		sub[i] = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) (table + 16 * i)));
+	}
+	for (k = 0; k + 32 <= length; k += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (p + k));
+		__m256i r = _mm256_setzero_si256();
+		
+		for (i = 0; i < 16; i++) {
+			__m256i idx = _mm256_adds_epu8(
+				_mm256_xor_si256(v, _mm256_set1_epi8((char) (i << 4))), bias);
+			r = _mm256_or_si256(r, _mm256_shuffle_epi8(sub[i], idx));
+		}
+		_mm256_storeu_si256((__m256i *) (p + k), r);
+	}
+	lookup_plane_c(p + k, length - k, table);
+}
+
+#endif
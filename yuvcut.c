@@ -17,16 +17,42 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA 
  *----------------------------------------------------------------------*/
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#define HAVE_SPLICE 1
+#else
+#define _DEFAULT_SOURCE
+#endif
+
 #define PROGNAME "yuvcut"
 #define VERSION "1.0"
 #define COPYRIGHT "Copyright 2006 Johannes Lehtinen"
 
+/** Number of frame headers checked before seeking directly over frames */
+#define SEEK_SAMPLES 16
+
+/** Methods for copying frame data, in the order they are tried */
+#define COPY_FILE_RANGE 0
+#define COPY_SENDFILE 1
+#define COPY_SPLICE 2
+#define COPY_READ_WRITE 3
+
+/** Maximum number of bytes copied at once by the threaded mode */
+#define CHUNK_LENGTH (8 << 20)
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef HAVE_SPLICE
+#include <sys/sendfile.h>
+#endif
 #include <yuv4mpeg.h>
 #include <mjpeg_logging.h>
 
@@ -76,15 +102,105 @@ struct abs_range_t {
 	
 };
 
+/** Consecutive frames copied as one piece in the threaded mode */
+typedef struct copy_job_t copy_job_t;
+struct copy_job_t {
+	
+	/** The input offset of the first frame */
+	off_t offset;
+	
+	/** The number of bytes to copy */
+	size_t length;
+	
+	/** The input index of the first frame */
+	int in_idx;
+	
+	/** The number of frames */
+	int frames;
+	
+	/** The output index of the first frame */
+	int out_idx;
+	
+	/** The output file index, or -1 for the standard output */
+	int file_idx;
+	
+	/** Whether the frames have been read to the chunk buffer */
+	int done;
+	
+};
+
+/* -----------------------------------------------------------------------
+ * Internal variables
+ * ---------------------------------------------------------------------*/
+
+/** The method currently used for copying frame data */
+#ifdef HAVE_SPLICE
+static int copy_method = COPY_FILE_RANGE;
+#else
+static int copy_method = COPY_READ_WRITE;
+#endif
+
+/** The number of threads used for copying seekable input */
+static int thread_count = 1;
+
+/** The copy jobs of the threaded mode */
+static copy_job_t *jobs = NULL;
+static int job_count = 0;
+static int job_size = 0;
+
+/** The next job to be started and the number of jobs written to output */
+static int next_job = 0;
+static int jobs_written = 0;
+
+/** The length of a frame including the header and of a chunk of frames */
+static off_t frame_stride = 0;
+static size_t chunk_length = 0;
+
+/** Chunk buffers for the jobs being copied to the standard output */
+static uint8_t **slots = NULL;
+static int slot_count = 0;
+
+/** The output file name pattern and stream information for jobs */
+static const char *job_pattern = NULL;
+static y4m_stream_info_t *job_si = NULL;
+
+/** Protects the job state and signals its changes */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+/** Descriptor of /dev/null for discarding frame data, or -1 if not open */
+#ifdef HAVE_SPLICE
+static int discard_fd = -1;
+
+/** Whether splicing to /dev/null may still be tried */
+static int use_discard_splice = 1;
+#endif
+
 /* -----------------------------------------------------------------------
  * Internal function declarations
  * ---------------------------------------------------------------------*/
 
 static void *checked_malloc(size_t size);
-static void parse_arguments(int argc, char *argv[], range_spec_t **ranges);
+static void parse_arguments(int argc, char *argv[], range_spec_t **ranges, char **pattern, int *segment_length);
+static void check_pattern(const char *pattern);
+static int open_output(const char *pattern, int index, y4m_stream_info_t *si);
+static void close_output(int fd);
 static range_spec_t *parse_range_spec(char *str);
 static void parse_location(char *str, int *sec, int *idx);
 static abs_range_t *range_specs_to_abs_ranges(range_spec_t *range_specs, y4m_ratio_t fps);
+static int seek_frames(int count, int frame_length);
+static int copy_frame_data(int fd, int length, uint8_t *buffer, int buffer_length);
+static ssize_t kernel_copy(int fd, size_t length);
+static int discard_frame_data(int length, uint8_t *buffer, int buffer_length);
+static int write_fully(int fd, const uint8_t *buffer, size_t length);
+static int read_fully_at(uint8_t *buffer, size_t length, off_t offset);
+static int frame_header_at(off_t offset);
+static int plan_jobs(abs_range_t *ranges, const char *pattern, int segment_length, int frame_length);
+static void add_job(off_t offset, off_t stride, int in_idx, int frames, int out_idx, int file_idx);
+static void run_jobs(const char *pattern, y4m_stream_info_t *si);
+static void *copy_worker(void *arg);
+static void copy_job_to_file(copy_job_t *job, uint8_t *buffer);
+static void check_frame_headers(const uint8_t *buffer, size_t length, int in_idx);
 
 /* -----------------------------------------------------------------------
  * Function definitions
@@ -103,13 +219,16 @@ int main(int argc, char *argv[]) {
 	y4m_stream_info_t si;
 	y4m_frame_info_t fi;
 	uint8_t *planes[Y4M_MAX_NUM_PLANES];
+	char *pattern = NULL;
+	int segment_length = 0;
 	int use_lseek;
 	int num_planes, frame_length;
 	int in_pos, out_pos;
+	int out_fd, out_idx, seg_pos;
 	int i;
 	
 	/* Parse arguments */
-	parse_arguments(argc, argv, &range_specs);
+	parse_arguments(argc, argv, &range_specs, &pattern, &segment_length);
 	
 	/* Read the stream header */
 	y4m_allow_unknown_tags(1);
@@ -131,10 +250,17 @@ int main(int argc, char *argv[]) {
 		planes[i] = checked_malloc(y4m_si_get_plane_length(&si, i));
 	}
 
-	/* Copy the header */
-	if (y4m_write_stream_header(STDOUT_FILENO, &si) != Y4M_OK) {
-		mjpeg_error_exit1("error writing stream header");
+	/* Copy the header unless writing to separate output files */
+	if (pattern == NULL) {
+		if (y4m_write_stream_header(STDOUT_FILENO, &si) != Y4M_OK) {
+			mjpeg_error_exit1("error writing stream header");
+		}
+		out_fd = STDOUT_FILENO;
+	} else {
+		out_fd = -1;
 	}
+	out_idx = 0;
+	seg_pos = 0;
 	
 	/* Check if lseek can be used on the input stream */
 	if (lseek(STDIN_FILENO, 0, SEEK_CUR) == -1) {
@@ -143,6 +269,18 @@ int main(int argc, char *argv[]) {
 		use_lseek = 1;
 	}
 	
+	/* Copy the ranges concurrently if the input is a regular file */
+	if (thread_count > 1 && use_lseek
+		&& plan_jobs(abs_ranges, pattern, segment_length, frame_length)) {
+		run_jobs(pattern, &si);
+		while (abs_ranges != NULL) {
+			abs_range_t *range = abs_ranges;
+			
+			abs_ranges = range->next_abs_range;
+			free(range);
+		}
+	}
+	
 	/* Copy the specified frames */
 	y4m_init_frame_info(&fi);
 	in_pos = 0;
@@ -150,6 +288,20 @@ int main(int argc, char *argv[]) {
 	while (abs_ranges != NULL) {
 		abs_range_t *range = abs_ranges;
 		
+		/* Start a new output file for each range if using a pattern */
+		if (pattern != NULL) {
+			if (out_fd != -1) {
+				close_output(out_fd);
+			}
+			out_fd = open_output(pattern, out_idx++, &si);
+			seg_pos = 0;
+		}
+		
+		/* Seek directly to the start of the range if possible */
+		if (use_lseek && in_pos < range->start_idx) {
+			in_pos += seek_frames(range->start_idx - in_pos, frame_length);
+		}
+		
 		/* Skip and copy frames */
 		while (in_pos <= range->end_idx || range->end_idx == -1) {
 			
@@ -170,19 +322,35 @@ int main(int argc, char *argv[]) {
 				if (lseek(STDIN_FILENO, frame_length, SEEK_CUR) == -1) {
 					mjpeg_error_exit1("failed to seek over input frame %d", in_pos);
 				}
-			} else {
-				if (y4m_read_frame_data(STDIN_FILENO, &si, &fi, planes)
-					!= Y4M_OK) {
+			} else if (in_pos < range->start_idx) {
+				if (discard_frame_data(frame_length, planes[0],
+					y4m_si_get_plane_length(&si, 0)) != Y4M_OK) {
 					mjpeg_error_exit1("failed to read input frame %d", in_pos);
 				}
 			}
 			
 			/* Copy the frame if it is part of the range */
 			if (in_pos >= range->start_idx) {
-				if (y4m_write_frame(STDOUT_FILENO, &si, &fi, planes)
+				
+				/* Start a new output file if the segment is full */
+				if (segment_length > 0 && seg_pos == segment_length) {
+					close_output(out_fd);
+					out_fd = open_output(pattern, out_idx++, &si);
+					seg_pos = 0;
+				}
+				seg_pos++;
+				
+				if (y4m_write_frame_header(out_fd, &si, &fi)
 					!= Y4M_OK) {
 					mjpeg_error_exit1("failed to write output frame %d", out_pos);
 				}
+				i = copy_frame_data(out_fd, frame_length, planes[0],
+					y4m_si_get_plane_length(&si, 0));
+				if (i == Y4M_ERR_EOF) {
+					mjpeg_error_exit1("failed to read input frame %d", in_pos);
+				} else if (i != Y4M_OK) {
+					mjpeg_error_exit1("failed to copy input frame %d to output frame %d", in_pos, out_pos);
+				}
 				mjpeg_info("wrote input frame %d as output frame %d", in_pos, out_pos);
 				out_pos++;
 			}
@@ -198,10 +366,18 @@ int main(int argc, char *argv[]) {
 	}
 	
 	/* Close input and output streams */	
+	if (pattern != NULL && out_fd != -1) {
+		close_output(out_fd);
+	}
 	if (close(STDOUT_FILENO) == -1) {
 		mjpeg_error_exit1("error closing output stream");
 	}
 	close(STDIN_FILENO);
+#ifdef HAVE_SPLICE
+	if (discard_fd != -1) {
+		close(discard_fd);
+	}
+#endif
 
 	/* Finalize data structures */
 	y4m_fini_frame_info(&fi);
@@ -235,8 +411,10 @@ static void *checked_malloc(size_t size) {
  * @param argc the number of arguments
  * @param argv the arguments
  * @param ranges pointer to the ranges list
+ * @param pattern where to store the output file name pattern, or NULL
+ * @param segment_length where to store the segment length, or 0
  */
-static void parse_arguments(int argc, char *argv[], range_spec_t **ranges) {
+static void parse_arguments(int argc, char *argv[], range_spec_t **ranges, char **pattern, int *segment_length) {
 	int configured = 0;
 	int i;
 	char *cp;
@@ -244,7 +422,7 @@ static void parse_arguments(int argc, char *argv[], range_spec_t **ranges) {
 	int verbosity = LOG_WARN;
 	
 	assert(*ranges == NULL);
-	while ((i = getopt(argc, argv, "c:hv")) != -1) {
+	while ((i = getopt(argc, argv, "c:ho:s:t:v")) != -1) {
 		switch (i) {
 			case 'c':
 				while ((cp = strrchr(optarg, ',')) != NULL) {
@@ -272,14 +450,38 @@ COPYRIGHT "\n"
 "of stream is assumed.  The ranges must not be overlapping and they must\n"
 "be specified in order.\n"
 "\n"
-"usage: " PROGNAME " [-h] [-c [START]-[[+]END][,[+]START-[[+]END]]...] [-v]\n"
+"usage: " PROGNAME " [-h] [-c [START]-[[+]END][,[+]START-[[+]END]]...]\n"
+"       [-o PATTERN] [-s LENGTH] [-t THREADS] [-v]\n"
 "options:\n"
 "  -h      print this help text and exit\n"
 "  -c [START]-[[+]END][,[+]START-[[+]END]]...\n"
 "          the ranges of frames to be copied\n"
+"  -o PATTERN\n"
+"          write each range to its own file, named by a printf style\n"
+"          pattern with one integer conversion, e.g. part%03d.y4m\n"
+"  -s LENGTH\n"
+"          split the ranges into segments of at most LENGTH frames, each\n"
+"          written to its own file (requires -o, whole stream if no -c)\n"
+"  -t N    copy the ranges of a seekable input file using N threads\n"
 "  -v      verbose operation (twice for debug)\n",
 					stdout);
 				exit(0);
+			case 'o':
+				check_pattern(optarg);
+				*pattern = optarg;
+				break;
+			case 's':
+				if (sscanf(optarg, "%d", segment_length) != 1
+					|| *segment_length <= 0) {
+					mjpeg_error_exit1("invalid segment length \"%s\"", optarg);
+				}
+				break;
+			case 't':
+				if (sscanf(optarg, "%d", &thread_count) != 1
+					|| thread_count <= 0) {
+					mjpeg_error_exit1("invalid number of threads \"%s\"", optarg);
+				}
+				break;
 			case 'v':
 				if (verbosity == LOG_WARN) {
 					verbosity = LOG_INFO;
@@ -292,6 +494,13 @@ COPYRIGHT "\n"
 		}
 	}
 	mjpeg_default_handler_verbosity(verbosity);
+	if (*segment_length > 0 && *pattern == NULL) {
+		mjpeg_error_exit1("segment length requires an output pattern (try -h for help)");
+	}
+	if (!configured && *segment_length > 0) {
+		*ranges = parse_range_spec(strcpy(checked_malloc(2), "-"));
+		configured = 1;
+	}
 	if (!configured) {
 		mjpeg_error_exit1("range not configured (try -h for help)");
 	}
@@ -413,6 +622,74 @@ static void parse_location(char *str, int *sec, int *idx) {
 	}
 }
 
+/**
+ * Checks that an output file name pattern contains exactly one integer
+ * conversion and otherwise only literal characters or "%%".
+ * 
+ * @param pattern the output file name pattern
+ */
+static void check_pattern(const char *pattern) {
+	const char *cp;
+	int conversions = 0;
+	
+	for (cp = pattern; (cp = strchr(cp, '%')) != NULL; cp++) {
+		if (cp[1] == '%') {
+			cp++;
+			continue;
+		}
+		cp += 1 + strspn(cp + 1, "0-");
+		cp += strspn(cp, "0123456789");
+		if (*cp != 'd' && *cp != 'i' && *cp != 'u' && *cp != 'x') {
+			mjpeg_error_exit1("invalid conversion in output pattern \"%s\"", pattern);
+		}
+		conversions++;
+	}
+	if (conversions != 1) {
+		mjpeg_error_exit1("output pattern \"%s\" must contain exactly one integer conversion", pattern);
+	}
+}
+
+/**
+ * Creates the output file with the specified index and writes the stream
+ * header to it.
+ * 
+ * @param pattern the output file name pattern
+ * @param index the index of the output file
+ * @param si the stream information
+ * @return the file descriptor of the output file
+ */
+static int open_output(const char *pattern, int index, y4m_stream_info_t *si) {
+	int size = snprintf(NULL, 0, pattern, index) + 1;
+	char *name;
+	int fd;
+	
+	if (size <= 0) {
+		mjpeg_error_exit1("invalid output pattern \"%s\"", pattern);
+	}
+	name = checked_malloc(size);
+	snprintf(name, size, pattern, index);
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+		mjpeg_error_exit1("could not create output file %s: %s", name, strerror(errno));
+	}
+	if (y4m_write_stream_header(fd, si) != Y4M_OK) {
+		mjpeg_error_exit1("error writing stream header to %s", name);
+	}
+	mjpeg_info("writing output file %s", name);
+	free(name);
+	return fd;
+}
+
+/**
+ * Closes an output file.
+ * 
+ * @param fd the file descriptor of the output file
+ */
+static void close_output(int fd) {
+	if (close(fd) == -1) {
+		mjpeg_error_exit1("error closing output file");
+	}
+}
+
 /**
  * Converts range specifications to absolute frame index ranges. Releases the
  * memory allocated for the specifications.
@@ -424,6 +701,7 @@ static void parse_location(char *str, int *sec, int *idx) {
 static abs_range_t *range_specs_to_abs_ranges(range_spec_t *range_specs, y4m_ratio_t fps) {
 	int pos = 0;
 	abs_range_t *ranges = NULL;
+	abs_range_t **tail = &ranges;
 	
 	/* Convert all range specifications */
 	while (range_specs != NULL) {
@@ -456,15 +734,540 @@ static abs_range_t *range_specs_to_abs_ranges(range_spec_t *range_specs, y4m_rat
 		if (range->end_idx < range->start_idx && range->end_idx != -1) {
 			mjpeg_error_exit1("a range has a negative size");
 		}
-		if (range->start_idx < pos) {
+		if (ranges != NULL && range->start_idx <= pos) {
 			mjpeg_error_exit1("a range starts before the previous range ends");
 		}
+		pos = range->end_idx;
 
 		/* Free the processed specification and move to next specification */		
 		range_specs = rs -> next_range_spec;
 		free(rs);
-		range->next_abs_range = ranges;
-		ranges = range;
+		range->next_abs_range = NULL;
+		*tail = range;
+		tail = &(range->next_abs_range);
 	}
 	return ranges;
 }
+
+/**
+ * Seeks directly over the specified number of frames, assuming plain frame
+ * headers without tags. A number of evenly spaced frame headers, including
+ * the first and the one after the skipped frames, are checked first. If the
+ * stream does not look regular then the file position is restored and the
+ * frames must be skipped one by one instead.
+ * 
+ * @param count the number of frames to skip
+ * @param frame_length the length of frame data
+ * @return the number of frames skipped, either count or 0
+ */
+static int seek_frames(int count, int frame_length) {
+	static const char header[] = Y4M_FRAME_MAGIC "\n";
+	off_t stride = (off_t) (sizeof(header) - 1) + frame_length;
+	off_t start;
+	int i;
+	
+	if ((start = lseek(STDIN_FILENO, 0, SEEK_CUR)) == -1) {
+		return 0;
+	}
+	for (i = 0; i < SEEK_SAMPLES; i++) {
+		off_t frame = (off_t) count * i / (SEEK_SAMPLES - 1);
+		char buf[sizeof(header) - 1];
+		
+		if (lseek(STDIN_FILENO, start + frame * stride, SEEK_SET) == -1
+			|| read(STDIN_FILENO, buf, sizeof(buf)) != sizeof(buf)
+			|| memcmp(buf, header, sizeof(buf))) {
+			mjpeg_debug("irregular frame headers, skipping frames one by one");
+			if (lseek(STDIN_FILENO, start, SEEK_SET) == -1) {
+				mjpeg_error_exit1("error seeking input stream");
+			}
+			return 0;
+		}
+	}
+	if (lseek(STDIN_FILENO, start + count * stride, SEEK_SET) == -1) {
+		mjpeg_error_exit1("error seeking input stream");
+	}
+	mjpeg_debug("seeked over %d input frames", count);
+	return count;
+}
+
+/**
+ * Copies frame data from the input stream to the output stream. The data is
+ * transferred within the kernel if the streams support it and otherwise
+ * read into the specified buffer and written out. A failing kernel method
+ * is not tried again for later frames.
+ * 
+ * @param fd the output file descriptor
+ * @param length the number of bytes to copy
+ * @param buffer the buffer used when copying via user space
+ * @param buffer_length the length of the buffer
+ * @return Y4M_OK on success, Y4M_ERR_EOF on unexpected end of input
+ *   or Y4M_ERR_SYSTEM on error
+ */
+static int copy_frame_data(int fd, int length, uint8_t *buffer, int buffer_length) {
+	ssize_t n;
+	
+	while (length > 0) {
+		
+		/* Transfer within the kernel if possible */
+		if (copy_method != COPY_READ_WRITE) {
+			n = kernel_copy(fd, length);
+			if (n == -1 && errno == EINTR) {
+				continue;
+			} else if (n == -1 && copy_method != COPY_READ_WRITE) {
+				return Y4M_ERR_SYSTEM;
+			} else if (n == 0) {
+				return Y4M_ERR_EOF;
+			} else if (n > 0) {
+				length -= n;
+				continue;
+			}
+		}
+		
+		/* Otherwise read and write through the buffer */
+		n = read(STDIN_FILENO, buffer,
+			length < buffer_length ? length : buffer_length);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n == -1) {
+			return Y4M_ERR_SYSTEM;
+		} else if (n == 0) {
+			return Y4M_ERR_EOF;
+		}
+		length -= n;
+		if (write_fully(fd, buffer, n) != Y4M_OK) {
+			return Y4M_ERR_SYSTEM;
+		}
+	}
+	return Y4M_OK;
+}
+
+/**
+ * Transfers data from the input stream to the output stream within the
+ * kernel using the current copy method. If the streams do not support the
+ * method then the next method is tried.
+ * 
+ * @param fd the output file descriptor
+ * @param length the maximum number of bytes to transfer
+ * @return the number of bytes transferred, 0 on end of input, or -1 on
+ *   error or if no kernel method is supported (copy_method is then
+ *   COPY_READ_WRITE)
+ */
+static ssize_t kernel_copy(int fd, size_t length) {
+#ifdef HAVE_SPLICE
+	static const char *names[] = { "copy_file_range", "sendfile", "splice" };
+	ssize_t n;
+	
+	while (copy_method != COPY_READ_WRITE) {
+		switch (copy_method) {
+			case COPY_FILE_RANGE:
+				n = copy_file_range(STDIN_FILENO, NULL, fd, NULL,
+					length, 0);
+				break;
+			case COPY_SENDFILE:
+				n = sendfile(fd, STDIN_FILENO, NULL, length);
+				break;
+			default:
+				n = splice(STDIN_FILENO, NULL, fd, NULL, length,
+					SPLICE_F_MOVE);
+				break;
+		}
+		if (n != -1 || (errno != EINVAL && errno != ENOSYS && errno != EXDEV
+			&& errno != EBADF && errno != ESPIPE && errno != EOPNOTSUPP)) {
+			return n;
+		}
+		mjpeg_debug("%s not supported by the streams", names[copy_method]);
+		copy_method++;
+	}
+#endif
+	return -1;
+}
+
+/**
+ * Discards frame data of a non-seekable input stream. The data is spliced
+ * to /dev/null within the kernel if possible and otherwise read into the
+ * specified buffer. If splicing is not supported then it is not tried
+ * again for later frames.
+ * 
+ * @param length the number of bytes to discard
+ * @param buffer the buffer used when reading via user space
+ * @param buffer_length the length of the buffer
+ * @return Y4M_OK on success, Y4M_ERR_EOF on unexpected end of input
+ *   or Y4M_ERR_SYSTEM on error
+ */
+static int discard_frame_data(int length, uint8_t *buffer, int buffer_length) {
+	ssize_t n;
+	
+#ifdef HAVE_SPLICE
+	if (use_discard_splice && discard_fd == -1
+		&& (discard_fd = open("/dev/null", O_WRONLY)) == -1) {
+		use_discard_splice = 0;
+	}
+	while (length > 0 && use_discard_splice) {
+		n = splice(STDIN_FILENO, NULL, discard_fd, NULL, length,
+			SPLICE_F_MOVE);
+		if (n > 0) {
+			length -= n;
+		} else if (n == 0) {
+			return Y4M_ERR_EOF;
+		} else if (errno == EINVAL || errno == ENOSYS || errno == EBADF) {
+			mjpeg_debug("splice not supported by the input stream");
+			use_discard_splice = 0;
+		} else if (errno != EINTR) {
+			return Y4M_ERR_SYSTEM;
+		}
+	}
+#endif
+	while (length > 0) {
+		n = read(STDIN_FILENO, buffer,
+			length < buffer_length ? length : buffer_length);
+		if (n > 0) {
+			length -= n;
+		} else if (n == 0) {
+			return Y4M_ERR_EOF;
+		} else if (errno != EINTR) {
+			return Y4M_ERR_SYSTEM;
+		}
+	}
+	return Y4M_OK;
+}
+
+/**
+ * Writes the whole buffer to the specified file descriptor.
+ * 
+ * @param fd the output file descriptor
+ * @param buffer the data to write
+ * @param length the number of bytes to write
+ * @return Y4M_OK on success or Y4M_ERR_SYSTEM on error
+ */
+static int write_fully(int fd, const uint8_t *buffer, size_t length) {
+	ssize_t n;
+	
+	while (length > 0) {
+		if ((n = write(fd, buffer, length)) != -1) {
+			buffer += n;
+			length -= n;
+		} else if (errno != EINTR) {
+			return Y4M_ERR_SYSTEM;
+		}
+	}
+	return Y4M_OK;
+}
+
+/**
+ * Reads the specified number of bytes from the specified input offset
+ * without changing the file position.
+ * 
+ * @param buffer where to store the data
+ * @param length the number of bytes to read
+ * @param offset the input offset
+ * @return Y4M_OK on success, Y4M_ERR_EOF on unexpected end of input
+ *   or Y4M_ERR_SYSTEM on error
+ */
+static int read_fully_at(uint8_t *buffer, size_t length, off_t offset) {
+	ssize_t n;
+	
+	while (length > 0) {
+		if ((n = pread(STDIN_FILENO, buffer, length, offset)) > 0) {
+			buffer += n;
+			length -= n;
+			offset += n;
+		} else if (n == 0) {
+			return Y4M_ERR_EOF;
+		} else if (errno != EINTR) {
+			return Y4M_ERR_SYSTEM;
+		}
+	}
+	return Y4M_OK;
+}
+
+/**
+ * Checks whether a plain frame header is located at the specified input
+ * offset.
+ * 
+ * @param offset the input offset
+ * @return whether a plain frame header was found
+ */
+static int frame_header_at(off_t offset) {
+	static const char header[] = Y4M_FRAME_MAGIC "\n";
+	uint8_t buf[sizeof(header) - 1];
+	
+	return read_fully_at(buf, sizeof(buf), offset) == Y4M_OK
+		&& !memcmp(buf, header, sizeof(buf));
+}
+
+/**
+ * Resolves the ranges to input byte offsets and divides them into copy
+ * jobs, assuming plain frame headers without tags. Jobs for the standard
+ * output are chunks of frames of at most CHUNK_LENGTH bytes, or a single
+ * frame, and jobs for output files are complete files. The stream length must be a
+ * whole number of frames, the ranges must be within the stream and a
+ * number of evenly spaced frame headers as well as the first frame header
+ * of each range are checked. Otherwise the ranges must be copied
+ * sequentially, which also reports any errors.
+ * 
+ * @param ranges the ranges to copy
+ * @param pattern the output file name pattern, or NULL
+ * @param segment_length the segment length, or 0
+ * @param frame_length the length of frame data
+ * @return whether the jobs were planned
+ */
+static int plan_jobs(abs_range_t *ranges, const char *pattern, int segment_length, int frame_length) {
+	off_t stride = (off_t) sizeof(Y4M_FRAME_MAGIC "\n") - 1 + frame_length;
+	off_t start, end, count;
+	abs_range_t *range;
+	int chunk_frames;
+	int out_pos = 0, file_idx = 0;
+	int regular;
+	int i;
+	
+	/* Check that the stream is regular */
+	if ((start = lseek(STDIN_FILENO, 0, SEEK_CUR)) == -1
+		|| (end = lseek(STDIN_FILENO, 0, SEEK_END)) == -1) {
+		return 0;
+	}
+	count = (end - start) / stride;
+	regular = ((end - start) % stride == 0 && count <= INT_MAX);
+	for (i = 0; regular && count > 0 && i < SEEK_SAMPLES; i++) {
+		regular = frame_header_at(
+			start + (count - 1) * i / (SEEK_SAMPLES - 1) * stride);
+	}
+	for (range = ranges; regular && range != NULL;
+		range = range->next_abs_range) {
+		regular = (range->start_idx < count && range->end_idx < count
+			&& frame_header_at(start + range->start_idx * stride));
+	}
+	if (lseek(STDIN_FILENO, start, SEEK_SET) == -1) {
+		mjpeg_error_exit1("error seeking input stream");
+	}
+	if (!regular) {
+		mjpeg_debug("irregular input stream, copying sequentially");
+		return 0;
+	}
+	
+	/* Divide the ranges into jobs */
+	chunk_frames = CHUNK_LENGTH / stride;
+	if (chunk_frames < 1) {
+		chunk_frames = 1;
+	}
+	frame_stride = stride;
+	chunk_length = chunk_frames * stride;
+	for (range = ranges; range != NULL; range = range->next_abs_range) {
+		int last = (range->end_idx == -1 ? count - 1 : range->end_idx);
+		int piece = chunk_frames;
+		int f;
+		
+		if (pattern != NULL) {
+			piece = (segment_length > 0 ? segment_length : last - range->start_idx + 1);
+		}
+		for (f = range->start_idx; f <= last; f += piece) {
+			int n = (last - f + 1 < piece ? last - f + 1 : piece);
+			
+			add_job(start + f * stride, stride, f, n, out_pos,
+				pattern != NULL ? file_idx++ : -1);
+			out_pos += n;
+		}
+	}
+	mjpeg_debug("copying %d jobs using %d threads", job_count, thread_count);
+	return 1;
+}
+
+/**
+ * Adds a copy job.
+ * 
+ * @param offset the input offset of the first frame
+ * @param stride the length of a frame including the header
+ * @param in_idx the input index of the first frame
+ * @param frames the number of frames
+ * @param out_idx the output index of the first frame
+ * @param file_idx the output file index, or -1 for the standard output
+ */
+static void add_job(off_t offset, off_t stride, int in_idx, int frames, int out_idx, int file_idx) {
+	copy_job_t *job;
+	
+	if (job_count == job_size) {
+		job_size = (job_size > 0 ? job_size * 2 : 64);
+		if ((jobs = realloc(jobs, job_size * sizeof(copy_job_t))) == NULL) {
+			mjpeg_error_exit1("memory allocation failed (%lu bytes)",
+				(unsigned long) (job_size * sizeof(copy_job_t)));
+		}
+	}
+	job = jobs + job_count++;
+	job->offset = offset;
+	job->length = frames * stride;
+	job->in_idx = in_idx;
+	job->frames = frames;
+	job->out_idx = out_idx;
+	job->file_idx = file_idx;
+	job->done = 0;
+}
+
+/**
+ * Runs the planned copy jobs using the configured number of threads. Jobs
+ * for output files are run independently. Jobs for the standard output
+ * are read into a ring of chunk buffers and written in order by the
+ * calling thread.
+ * 
+ * @param pattern the output file name pattern, or NULL
+ * @param si the stream information
+ */
+static void run_jobs(const char *pattern, y4m_stream_info_t *si) {
+	pthread_t *threads;
+	int i;
+	
+	job_pattern = pattern;
+	job_si = si;
+	if (pattern == NULL) {
+		slot_count = thread_count + 2;
+		slots = checked_malloc(slot_count * sizeof(uint8_t *));
+		for (i = 0; i < slot_count; i++) {
+			slots[i] = checked_malloc(chunk_length);
+		}
+	}
+	
+	/* Start the threads */
+	threads = checked_malloc(thread_count * sizeof(pthread_t));
+	for (i = 0; i < thread_count; i++) {
+		if (pthread_create(threads + i, NULL, copy_worker, NULL) != 0) {
+			mjpeg_error_exit1("could not create a copying thread");
+		}
+	}
+	
+	/* Write the chunks to the standard output in order */
+	for (i = 0; pattern == NULL && i < job_count; i++) {
+		copy_job_t *job = jobs + i;
+		
+		pthread_mutex_lock(&job_lock);
+		while (!job->done) {
+			pthread_cond_wait(&job_cond, &job_lock);
+		}
+		pthread_mutex_unlock(&job_lock);
+		if (write_fully(STDOUT_FILENO, slots[i % slot_count], job->length)
+			!= Y4M_OK) {
+			mjpeg_error_exit1("failed to write output frame %d", job->out_idx);
+		}
+		mjpeg_info("wrote input frames %d - %d as output frames %d - %d",
+			job->in_idx, job->in_idx + job->frames - 1,
+			job->out_idx, job->out_idx + job->frames - 1);
+		pthread_mutex_lock(&job_lock);
+		jobs_written++;
+		pthread_cond_broadcast(&job_cond);
+		pthread_mutex_unlock(&job_lock);
+	}
+	
+	/* Wait for the threads and release resources */
+	for (i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	for (i = 0; i < slot_count; i++) {
+		free(slots[i]);
+	}
+	free(slots);
+	free(jobs);
+	jobs = NULL;
+	job_count = job_size = 0;
+}
+
+/**
+ * Copying thread. Takes jobs in order until none are left. A job for the
+ * standard output is started only when its chunk buffer has been written.
+ * 
+ * @param arg unused
+ * @return NULL
+ */
+static void *copy_worker(void *arg) {
+	uint8_t *buffer = NULL;
+	int i;
+	
+	(void) arg;
+	if (job_pattern != NULL) {
+		buffer = checked_malloc(chunk_length);
+	}
+	for (;;) {
+		copy_job_t *job;
+		
+		/* Take the next job */
+		pthread_mutex_lock(&job_lock);
+		if (next_job == job_count) {
+			pthread_mutex_unlock(&job_lock);
+			break;
+		}
+		i = next_job++;
+		while (job_pattern == NULL && i - jobs_written >= slot_count) {
+			pthread_cond_wait(&job_cond, &job_lock);
+		}
+		pthread_mutex_unlock(&job_lock);
+		job = jobs + i;
+		
+		/* Copy to an output file or read into the chunk buffer */
+		if (job_pattern != NULL) {
+			copy_job_to_file(job, buffer);
+		} else {
+			if (read_fully_at(slots[i % slot_count], job->length, job->offset)
+				!= Y4M_OK) {
+				mjpeg_error_exit1("failed to read input frames %d - %d",
+					job->in_idx, job->in_idx + job->frames - 1);
+			}
+			check_frame_headers(slots[i % slot_count], job->length,
+				job->in_idx);
+			pthread_mutex_lock(&job_lock);
+			job->done = 1;
+			pthread_cond_broadcast(&job_cond);
+			pthread_mutex_unlock(&job_lock);
+		}
+	}
+	free(buffer);
+	return NULL;
+}
+
+/**
+ * Copies the frames of a job to a new output file in chunks of frames.
+ * 
+ * @param job the copy job
+ * @param buffer the buffer of chunk_length bytes
+ */
+static void copy_job_to_file(copy_job_t *job, uint8_t *buffer) {
+	int fd = open_output(job_pattern, job->file_idx, job_si);
+	size_t pos = 0;
+	
+	while (pos < job->length) {
+		size_t n = job->length - pos;
+		
+		if (n > chunk_length) {
+			n = chunk_length;
+		}
+		if (read_fully_at(buffer, n, job->offset + pos) != Y4M_OK) {
+			mjpeg_error_exit1("failed to read input frames %d - %d",
+				job->in_idx, job->in_idx + job->frames - 1);
+		}
+		check_frame_headers(buffer, n, job->in_idx + pos / frame_stride);
+		if (write_fully(fd, buffer, n) != Y4M_OK) {
+			mjpeg_error_exit1("failed to write output frames %d - %d",
+				job->out_idx, job->out_idx + job->frames - 1);
+		}
+		pos += n;
+	}
+	close_output(fd);
+	mjpeg_info("wrote input frames %d - %d as output frames %d - %d",
+		job->in_idx, job->in_idx + job->frames - 1,
+		job->out_idx, job->out_idx + job->frames - 1);
+}
+
+/**
+ * Checks that each frame read into a buffer starts with a plain frame
+ * header, as only some of the headers were checked when planning jobs.
+ * 
+ * @param buffer the frames
+ * @param length the number of bytes in the buffer
+ * @param in_idx the input index of the first frame
+ */
+static void check_frame_headers(const uint8_t *buffer, size_t length, int in_idx) {
+	static const char header[] = Y4M_FRAME_MAGIC "\n";
+	size_t pos;
+	
+	for (pos = 0; pos < length; pos += frame_stride, in_idx++) {
+		if (memcmp(buffer + pos, header, sizeof(header) - 1)) {
+			mjpeg_error_exit1("error reading frame header at input frame %d", in_idx);
+		}
+	}
+}
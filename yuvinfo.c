@@ -31,14 +31,50 @@
 
 #define PI 3.14159265358979323846
 
+/* Number of frame headers checked when counting frames by file size */
+#define COUNT_SAMPLES 16
+
+/* Frame index file magic and the lengths of its header and entries */
+#define INDEX_MAGIC "Y4MIDX1\n"
+#define INDEX_HEADER_LENGTH 72
+#define INDEX_ENTRY_LENGTH 16
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <string.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <yuv4mpeg.h>
 
+/* Location of a frame header in the mapped input */
+typedef struct {
+	size_t offset;
+	int header_length;
+} frame_entry_t;
+
+/* Frames found by a scan, entries are recorded only if requested */
+typedef struct {
+	int record;
+	frame_entry_t *entries;
+	int count;
+	int size;
+} frame_list_t;
+
+/* Byte range of the input scanned by a thread */
+typedef struct {
+	pthread_t thread;
+	size_t begin;
+	size_t limit;
+	size_t first;
+	size_t next;
+	int valid;
+	frame_list_t frames;
+} chunk_t;
+
 static y4m_stream_info_t stream_info;
 static int plane_count;
 static int plane_length[Y4M_MAX_NUM_PLANES];
@@ -46,14 +82,33 @@ static int plane_width[Y4M_MAX_NUM_PLANES];
 static int plane_height[Y4M_MAX_NUM_PLANES];
 static uint8_t *planes[Y4M_MAX_NUM_PLANES];
 static double sqrt2pi;
+static int thread_count = 1;
+static const uint8_t *map_data = NULL;
+static size_t map_start;
+static size_t map_end;
+static int map_frame_length;
 
+static int count_frames(int frame_length);
+static void map_input(int frame_length);
+static void unmap_input(void);
+static void scan_frames(frame_list_t *frames);
+static void *scan_chunk(void *arg);
+static size_t walk_frames(size_t pos, size_t limit, frame_list_t *frames, int strict);
+static size_t header_length_at(size_t pos);
+static void add_frame(frame_list_t *frames, size_t offset, int header_length);
+static void write_index(const char *name, const frame_list_t *frames);
+static void put_u32(uint8_t *b, uint32_t v);
+static void put_u64(uint8_t *b, uint64_t v);
 static void overlay_histograms(void);
+static void count_values(const uint8_t *p, int length, unsigned long *vf);
+static void normal_curve(double *curve, double avg, double stddev);
 static double ndf(double x, double avg, double stddev);
 
 int main(int argc, char *argv[]) {
 	int display = DISPLAY_ALL;
 	int piping = 0;
 	int show_histograms = 0;
+	const char *index_name = NULL;
 	y4m_frame_info_t frame_info;
 	int frame_length;
 	int use_lseek;
@@ -64,7 +119,7 @@ int main(int argc, char *argv[]) {
 	sqrt2pi = sqrt(2 * PI);
 	
 	/* Read options */
-	while ((i = getopt(argc, argv, "hlcH")) != -1) {
+	while ((i = getopt(argc, argv, "hlcHi:t:")) != -1) {
 		switch (i) {
 			case 'h':
 				fputs(
@@ -75,12 +130,14 @@ COPYRIGHT "\n"
 "format similar to lavinfo. Optionally copies the input to the standard output\n"
 "and can also overlay YUV histograms in the output video stream.\n"
 "\n"
-"usage: " PROGNAME " [-h] [-l] [-c] [-H]\n"
+"usage: " PROGNAME " [-h] [-l] [-c] [-H] [-i file] [-t threads]\n"
 "options:\n"
 "  -h     print this help text and exit\n"
 "  -l     display only the length of the stream in frames\n"
 "  -c     copy the input to stdout and write information to stderr\n"
-"  -H     overlay YUV histograms in the output video stream (implies -c)\n",
+"  -H     overlay YUV histograms in the output video stream (implies -c)\n"
+"  -i F   write a frame index of a seekable input file to file F\n"
+"  -t N   scan a seekable input file using N threads\n",
 					stdout);
 				exit(0);
 			case 'l':
@@ -93,6 +150,18 @@ COPYRIGHT "\n"
 				show_histograms = 1;
 				piping = 1;
 				break;
+			case 'i':
+				index_name = optarg;
+				break;
+			case 't':
+				thread_count = atoi(optarg);
+				if (thread_count <= 0) {
+					fprintf(stderr,
+						PROGNAME ": error: invalid number of threads %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
 			default:
 				fputs(PROGNAME ": error: unknown option\n", stderr);
 				exit(1);
@@ -158,26 +227,62 @@ COPYRIGHT "\n"
 			exit(1);
 		}
 	}	
-	while ((i = y4m_read_frame_header(STDIN_FILENO, &stream_info, &frame_info)) == Y4M_OK) {
-		if (use_lseek) {
-			if (lseek(STDIN_FILENO, frame_length, SEEK_CUR) == -1) {
-				fputs(PROGNAME ": error: error seeking frame data\n", stderr);
-				exit(1);
-			}
-		} else {
-			if (y4m_read_frame_data(STDIN_FILENO, &stream_info, &frame_info, planes) != Y4M_OK) {
-				fputs(PROGNAME ": error: error reading frame data\n", stderr);
-				exit(1);
-			}
-			if (show_histograms) {
-				overlay_histograms();
-			}
-			if (piping && y4m_write_frame(STDOUT_FILENO, &stream_info, &frame_info, planes) != Y4M_OK) {
-				fputs(PROGNAME ": error error writing frame\n", stderr);
-				exit(1);
+	if (index_name != NULL && !use_lseek) {
+		fputs(PROGNAME ": error: frame index requires seekable input without -c\n", stderr);
+		exit(1);
+	}
+	
+	/*
+	 * Build the frame index if requested. Otherwise count frames by file
+	 * size if possible, or scan frame headers, in parallel if requested.
+	 */
+	if (thread_count > 1 && !use_lseek) {
+		fputs(PROGNAME ": warning: -t has no effect on non-seekable input or with -c\n",
+			stderr);
+	}
+	if (index_name != NULL) {
+		frame_list_t frames = { 1, NULL, 0, 0 };
+		
+		map_input(frame_length);
+		scan_frames(&frames);
+		write_index(index_name, &frames);
+		unmap_input();
+		free(frames.entries);
+		length = frames.count;
+		i = Y4M_ERR_EOF;
+	} else if (use_lseek && (i = count_frames(frame_length)) != -1) {
+		length = i;
+		i = Y4M_ERR_EOF;
+	} else if (use_lseek && thread_count > 1) {
+		frame_list_t frames = { 0, NULL, 0, 0 };
+		
+		map_input(frame_length);
+		scan_frames(&frames);
+		unmap_input();
+		length = frames.count;
+		i = Y4M_ERR_EOF;
+	} else {
+		while ((i = y4m_read_frame_header(STDIN_FILENO, &stream_info, &frame_info)) == Y4M_OK) {
+			if (use_lseek) {
+				if (lseek(STDIN_FILENO, frame_length, SEEK_CUR) == -1) {
+					fputs(PROGNAME ": error: error seeking frame data\n", stderr);
+					exit(1);
+				}
+			} else {
+				if (y4m_read_frame_data(STDIN_FILENO, &stream_info, &frame_info, planes) != Y4M_OK) {
+					fputs(PROGNAME ": error: error reading frame data\n", stderr);
+					exit(1);
+				}
+				if (show_histograms) {
+					overlay_histograms();
+				}
+				if (piping && y4m_write_frame(STDOUT_FILENO, &stream_info, &frame_info, planes) != Y4M_OK) {
+					fputs(PROGNAME ": error error writing frame\n", stderr);
+					exit(1);
+				}
 			}
+			length++;
 		}
-		length++;
 	}
 	if (i != Y4M_ERR_EOF) {
 		fputs(PROGNAME ": error: error reading frame header\n", stderr);
@@ -251,12 +356,335 @@ COPYRIGHT "\n"
 	return 0;
 }
 
+/*
+ * Counts the frames of a seekable stream from the file size, assuming plain
+ * frame headers without tags. A number of evenly spaced frame headers are
+ * checked. Returns -1 and restores the file position if the stream does not
+ * look regular, in which case frame headers must be scanned instead.
+ */
+static int count_frames(int frame_length) {
+	static const char header[] = Y4M_FRAME_MAGIC "\n";
+	off_t stride = (off_t) (sizeof(header) - 1) + frame_length;
+	off_t start, end;
+	off_t count;
+	int i;
+	
+	if ((start = lseek(STDIN_FILENO, 0, SEEK_CUR)) == -1
+		|| (end = lseek(STDIN_FILENO, 0, SEEK_END)) == -1) {
+		return -1;
+	}
+	count = (end - start) / stride;
+	if ((end - start) % stride != 0 || count > 0x7fffffff) {
+		count = -1;
+	}
+	for (i = 0; count > 0 && i < COUNT_SAMPLES; i++) {
+		off_t frame = (count - 1) * i / (COUNT_SAMPLES - 1);
+		char buf[sizeof(header) - 1];
+		
+		if (lseek(STDIN_FILENO, start + frame * stride, SEEK_SET) == -1
+			|| read(STDIN_FILENO, buf, sizeof(buf)) != sizeof(buf)
+			|| memcmp(buf, header, sizeof(buf))) {
+			count = -1;
+		}
+	}
+	if (count == -1 && lseek(STDIN_FILENO, start, SEEK_SET) == -1) {
+		fputs(PROGNAME ": error: error seeking stream\n", stderr);
+		exit(1);
+	}
+	return (int) count;
+}
+
+/* Maps the seekable input stream to memory for scanning */
+static void map_input(int frame_length) {
+	off_t start, end;
+	
+	if ((start = lseek(STDIN_FILENO, 0, SEEK_CUR)) == -1
+		|| (end = lseek(STDIN_FILENO, 0, SEEK_END)) == -1) {
+		fputs(PROGNAME ": error: error seeking stream\n", stderr);
+		exit(1);
+	}
+	if ((uint64_t) end > (size_t) -1) {
+		fputs(PROGNAME ": error: input too large to be mapped\n", stderr);
+		exit(1);
+	}
+	if (end > 0 && (map_data = mmap(NULL, end, PROT_READ, MAP_SHARED,
+		STDIN_FILENO, 0)) == MAP_FAILED) {
+		fputs(PROGNAME ": error: could not map input\n", stderr);
+		exit(1);
+	}
+	map_start = start;
+	map_end = end;
+	map_frame_length = frame_length;
+}
+
+/* Unmaps the input stream once it has been scanned */
+static void unmap_input(void) {
+	if (map_data != NULL) {
+		munmap((void *) map_data, map_end);
+		map_data = NULL;
+	}
+}
+
+/*
+ * Locates the frames of the mapped input. If multi-threaded, the input is
+ * split into byte ranges which are scanned in parallel, each thread first
+ * synchronizing on a frame header. The results are then merged in order.
+ * A range whose first frame does not continue the frames of the preceding
+ * ranges, e.g. because the thread synchronized on a FRAME marker within
+ * frame data, is scanned again sequentially.
+ */
+static void scan_frames(frame_list_t *frames) {
+	chunk_t *chunks;
+	size_t pos;
+	int i;
+	
+	if (thread_count <= 1) {
+		walk_frames(map_start, map_end, frames, 1);
+		return;
+	}
+	if ((chunks = calloc(thread_count, sizeof(chunk_t))) == NULL) {
+		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+		exit(1);
+	}
+	for (i = 0; i < thread_count; i++) {
+		chunk_t *c = chunks + i;
+		
+		c->begin = map_start + (map_end - map_start) / thread_count * i;
+		c->limit = (i == thread_count - 1 ? map_end
+			: map_start + (map_end - map_start) / thread_count * (i + 1));
+		c->frames.record = frames->record;
+		if (pthread_create(&c->thread, NULL, scan_chunk, c) != 0) {
+			fputs(PROGNAME ": error: could not create a scanning thread\n", stderr);
+			exit(1);
+		}
+	}
+	pos = map_start;
+	for (i = 0; i < thread_count; i++) {
+		chunk_t *c = chunks + i;
+		
+		pthread_join(c->thread, NULL);
+		if (pos >= c->limit) {
+			
+			/* No frame starts within this range */
+		} else if (c->valid && c->first == pos) {
+			int j;
+			
+			if (frames->record) {
+				for (j = 0; j < c->frames.count; j++) {
+					add_frame(frames, c->frames.entries[j].offset,
+						c->frames.entries[j].header_length);
+				}
+			} else {
+				frames->count += c->frames.count;
+			}
+			pos = c->next;
+		} else {
+			pos = walk_frames(pos, c->limit, frames, 1);
+		}
+		free(c->frames.entries);
+	}
+	free(chunks);
+}
+
+/* Synchronizes on the first frame within a byte range and scans the range */
+static void *scan_chunk(void *arg) {
+	chunk_t *c = arg;
+	size_t pos = c->begin;
+	
+	while (pos < c->limit) {
+		const uint8_t *f = memchr(map_data + pos, Y4M_FRAME_MAGIC[0], c->limit - pos);
+		size_t hlen;
+		
+		if (f == NULL) {
+			break;
+		}
+		pos = f - map_data;
+		if ((hlen = header_length_at(pos)) != 0) {
+			size_t next = pos + hlen + map_frame_length;
+			
+			if (next >= map_end || header_length_at(next) != 0) {
+				c->first = pos;
+				c->next = walk_frames(pos, c->limit, &c->frames, 0);
+				c->valid = (c->next != (size_t) -1);
+				return NULL;
+			}
+		}
+		pos++;
+	}
+	c->valid = 0;
+	return NULL;
+}
+
+/*
+ * Walks the frames from the specified position until a frame starts at or
+ * after the limit and returns that position. An invalid frame header is an
+ * error if strict, otherwise (size_t) -1 is returned. The last frame may be
+ * truncated, in which case the returned position is past the end.
+ */
+static size_t walk_frames(size_t pos, size_t limit, frame_list_t *frames, int strict) {
+	while (pos < limit) {
+		size_t hlen = header_length_at(pos);
+		
+		if (hlen == 0) {
+			if (strict) {
+				fputs(PROGNAME ": error: error reading frame header\n", stderr);
+				exit(1);
+			}
+			return (size_t) -1;
+		}
+		add_frame(frames, pos, hlen);
+		pos += hlen + map_frame_length;
+	}
+	return pos;
+}
+
+/*
+ * Returns the length of the frame header at the specified position of the
+ * mapped input, or 0 if there is no valid frame header.
+ */
+static size_t header_length_at(size_t pos) {
+	const size_t magic_length = strlen(Y4M_FRAME_MAGIC);
+	size_t limit = map_end - pos;
+	const uint8_t *nl;
+	
+	if (limit > Y4M_LINE_MAX) {
+		limit = Y4M_LINE_MAX;
+	}
+	if (limit <= magic_length
+		|| memcmp(map_data + pos, Y4M_FRAME_MAGIC, magic_length)
+		|| (map_data[pos + magic_length] != '\n' && map_data[pos + magic_length] != ' ')
+		|| (nl = memchr(map_data + pos + magic_length, '\n', limit - magic_length)) == NULL) {
+		return 0;
+	}
+	return nl - (map_data + pos) + 1;
+}
+
+/* Records a frame, or only counts it if entries are not recorded */
+static void add_frame(frame_list_t *frames, size_t offset, int header_length) {
+	if (frames->count == 0x7fffffff) {
+		fputs(PROGNAME ": error: too many frames\n", stderr);
+		exit(1);
+	}
+	if (!frames->record) {
+		frames->count++;
+		return;
+	}
+	if (frames->count >= frames->size) {
+		frames->size = (frames->size > 0 ? frames->size * 2 : 1024);
+		frames->entries = realloc(frames->entries, sizeof(frame_entry_t) * frames->size);
+		if (frames->entries == NULL) {
+			fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+			exit(1);
+		}
+	}
+	frames->entries[frames->count].offset = offset;
+	frames->entries[frames->count].header_length = header_length;
+	frames->count++;
+}
+
+/*
+ * Writes a frame index of the mapped input stream. The index file starts
+ * with INDEX_MAGIC followed by the frame width, height, chroma mode,
+ * interlacing mode, frame rate, sample aspect ratio and frame data length
+ * as 32-bit integers, four reserved bytes and the frame count, offset of
+ * the first frame and total tag length as 64-bit integers, all
+ * little-endian. Each frame has an entry of the 64-bit header offset,
+ * 32-bit header length and 32-bit offset of the frame tags within the tag
+ * area, which follows the entries. The tags of a frame are the header
+ * bytes between the frame magic and the terminating newline.
+ */
+static void write_index(const char *name, const frame_list_t *frames) {
+	const size_t magic_length = strlen(Y4M_FRAME_MAGIC);
+	uint8_t header[INDEX_HEADER_LENGTH];
+	uint8_t entry[INDEX_ENTRY_LENGTH];
+	uint64_t tag_length = 0;
+	FILE *f;
+	int i;
+	
+	if (frames->count > 0) {
+		const frame_entry_t *last = frames->entries + frames->count - 1;
+		
+		if (map_end - last->offset - last->header_length < (size_t) map_frame_length) {
+			fputs(PROGNAME ": error: truncated frame data\n", stderr);
+			exit(1);
+		}
+	}
+	if ((f = fopen(name, "wb")) == NULL) {
+		fprintf(stderr, PROGNAME ": error: could not open index file %s\n", name);
+		exit(1);
+	}
+	
+	/* Write the header */
+	memset(header, 0, sizeof(header));
+	memcpy(header, INDEX_MAGIC, 8);
+	put_u32(header + 8, y4m_si_get_width(&stream_info));
+	put_u32(header + 12, y4m_si_get_height(&stream_info));
+	put_u32(header + 16, y4m_si_get_chroma(&stream_info));
+	put_u32(header + 20, y4m_si_get_interlace(&stream_info));
+	put_u32(header + 24, y4m_si_get_framerate(&stream_info).n);
+	put_u32(header + 28, y4m_si_get_framerate(&stream_info).d);
+	put_u32(header + 32, y4m_si_get_sampleaspect(&stream_info).n);
+	put_u32(header + 36, y4m_si_get_sampleaspect(&stream_info).d);
+	put_u32(header + 40, map_frame_length);
+	put_u64(header + 48, frames->count);
+	put_u64(header + 56, map_start);
+	for (i = 0; i < frames->count; i++) {
+		tag_length += frames->entries[i].header_length - magic_length - 1;
+	}
+	put_u64(header + 64, tag_length);
+	if (fwrite(header, INDEX_HEADER_LENGTH, 1, f) != 1) {
+		fputs(PROGNAME ": error: error writing index file\n", stderr);
+		exit(1);
+	}
+	
+	/* Write the entries */
+	tag_length = 0;
+	for (i = 0; i < frames->count; i++) {
+		put_u64(entry, frames->entries[i].offset);
+		put_u32(entry + 8, frames->entries[i].header_length);
+		put_u32(entry + 12, tag_length);
+		if (fwrite(entry, INDEX_ENTRY_LENGTH, 1, f) != 1) {
+			fputs(PROGNAME ": error: error writing index file\n", stderr);
+			exit(1);
+		}
+		tag_length += frames->entries[i].header_length - magic_length - 1;
+	}
+	
+	/* Write the tags of each frame */
+	for (i = 0; i < frames->count; i++) {
+		size_t length = frames->entries[i].header_length - magic_length - 1;
+		
+		if (length > 0 && fwrite(map_data + frames->entries[i].offset + magic_length,
+			length, 1, f) != 1) {
+			fputs(PROGNAME ": error: error writing index file\n", stderr);
+			exit(1);
+		}
+	}
+	if (fclose(f) != 0) {
+		fputs(PROGNAME ": error: error writing index file\n", stderr);
+		exit(1);
+	}
+}
+
+static void put_u32(uint8_t *b, uint32_t v) {
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+	b[3] = v >> 24;
+}
+
+static void put_u64(uint8_t *b, uint64_t v) {
+	put_u32(b, (uint32_t) v);
+	put_u32(b + 4, (uint32_t) (v >> 32));
+}
+
 static void overlay_histograms(void) {
 	int i;
 	
 	/* Calculate and overlay histograms for each plane */
 	for (i = 0; i < plane_count; i++) {
 		unsigned long vf[256];
+		double curve[256];
 		unsigned long max;
 		double avg, var, stddev;
 		int x, y;
@@ -264,14 +692,7 @@ static void overlay_histograms(void) {
 		uint8_t *p;
 
 		/* Calculate value frequency */		
-		for (j = 0; j < 256; j++) {
-			vf[j] = 0;
-		}
-		p = planes[i];
-		for (j = plane_length[i]; j != 0; j--) {
-			vf[*p]++;
-			p++;
-		}
+		count_values(planes[i], plane_length[i], vf);
 		
 		/* Draw histogram background */
 		y = plane_height[0] - 64 * (plane_count - i) + 4;
@@ -316,12 +737,13 @@ static void overlay_histograms(void) {
 		}
 		
 		/* Draw normal distribution */
+		normal_curve(curve, avg, stddev);
 		x = (plane_width[0] - 256) / 2;
 		y = plane_height[0] - 64 * (plane_count - i - 1);
 		for (j = 0; j < 256; j++, x++) {
 			int h;
 			
-			h = rint(60 * plane_length[i] * ndf(j, avg, stddev) / max);
+			h = rint(60 * plane_length[i] * curve[j] / max);
 			if (h > 0 && h <= 60) {
 				p = planes[0] + (y - h) * plane_width[0] + x;
 				*p = (MIN_Y + MAX_Y) / 2;
@@ -330,6 +752,69 @@ static void overlay_histograms(void) {
 	}
 }
 
+/*
+ * Counts the sample values of a plane for the histogram overlay. Every
+ * fourth sample goes to the same one of four tables, which are merged into
+ * vf at the end. Flat areas then increment four counters in turn rather
+ * than one counter back to back.
+ */
+static void count_values(const uint8_t *p, int length, unsigned long *vf) {
+	uint32_t bank[4][256];
+	int k, v;
+	
+	memset(bank, 0, sizeof(bank));
+	for (k = 0; k + 4 <= length; k += 4) {
+		bank[0][p[k]]++;
+		bank[1][p[k + 1]]++;
+		bank[2][p[k + 2]]++;
+		bank[3][p[k + 3]]++;
+	}
+	for (; k < length; k++) {
+		bank[0][p[k]]++;
+	}
+	for (v = 0; v < 256; v++) {
+		vf[v] = (unsigned long) bank[0][v] + bank[1][v] + bank[2][v] + bank[3][v];
+	}
+}
+
+/*
+ * Tabulates the normal distribution for all sample values. Starting from
+ * the value closest to the average, each value is derived from its
+ * neighbour by multiplying with a ratio which itself changes by a constant
+ * factor, so only a few exp() calls are needed per plane. All factors are
+ * at most one, so the recurrence can not overflow.
+ */
+static void normal_curve(double *curve, double avg, double stddev) {
+	double c, q;
+	double e0, e, r;
+	int j0, j;
+	
+	if (stddev <= 0) {
+		for (j = 0; j < 256; j++) {
+			curve[j] = ndf(j, avg, stddev);
+		}
+		return;
+	}
+	c = 1 / (stddev * sqrt2pi);
+	q = exp(-1 / (stddev * stddev));
+	j0 = (int) floor(avg + 0.5);
+	e0 = exp(-0.5 * pow((j0 - avg) / stddev, 2));
+	e = e0;
+	r = exp(-(2 * (j0 - avg) + 1) / (2 * stddev * stddev));
+	for (j = j0; j < 256; j++) {
+		curve[j] = c * e;
+		e *= r;
+		r *= q;
+	}
+	e = e0;
+	r = exp(-(1 - 2 * (j0 - avg)) / (2 * stddev * stddev));
+	for (j = j0 - 1; j >= 0; j--) {
+		e *= r;
+		r *= q;
+		curve[j] = c * e;
+	}
+}
+
 static double ndf(double x, double avg, double stddev) {
 	return (1/(stddev * sqrt2pi)) * exp(-0.5 * pow((x - avg) / stddev, 2));
 }
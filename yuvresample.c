@@ -26,12 +26,77 @@
 
 #define VERBOSE_DEBUG 2
 
+/* Size of the scratch buffer used to discard unused input frames */
+#define DISCARD_CHUNK 65536
+
+/* Largest period (in output frames) of a precomputed resampling schedule */
+#define SCHEDULE_MAX_FRAMES 16384
+
+/* Input actions of a schedule entry */
+#define ACTION_READ 'R'
+#define ACTION_SKIP 'K'
+#define ACTION_STEP 'S'
+
+/* Largest frame/field time difference supported by the fixed-point blend */
+#define BLEND_MAX_TIMEDIFF 32767
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_SIMD 1
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <yuv4mpeg.h>
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Weights and fixed-point reciprocal for blending two source lines */
+typedef struct blend_t blend_t;
+struct blend_t {
+	int w[2];
+	int timediff;
+	uint32_t mul;
+	int shift;
+	void (*kernel)(uint8_t *dst, const uint8_t *src0, const uint8_t *src1,
+		int width, const blend_t *b);
+};
+
+/* Sources and blending parameters of an output field */
+typedef struct field_t field_t;
+struct field_t {
+	int voffset;
+	int step;
+	int srcframe[2];
+	int srcfield[2];
+	blend_t blend;
+};
+
+/* Input actions and field parameters for producing one output frame */
+typedef struct sched_frame_t sched_frame_t;
+struct sched_frame_t {
+	
+	/* Output position relative to the oldest buffered input frame */
+	int offset;
+	
+	/* Number of buffered input frames before the actions */
+	int buffered;
+	
+	/* Whether identical to the previous output frame */
+	int repeat;
+	
+	/* Input actions for each field as a string of ACTION_* characters */
+	char *actions[2];
+	
+	/* Output field parameters */
+	field_t fields[2];
+};
 
 static y4m_ratio_t input_fps = { 0, 0 };
 static y4m_ratio_t output_fps = { 0, 0 };
@@ -39,6 +104,8 @@ static int input_interlacing = Y4M_UNKNOWN;
 static int output_interlacing = Y4M_UNKNOWN;
 static int sampling_mode = SAMPLING_AVERAGE;
 static int verbose = 0;
+static int thread_count = 1;
+static int pipeline_frames = 0;
 
 static y4m_stream_info_t input_si;
 static y4m_stream_info_t output_si;
@@ -47,29 +114,110 @@ static int plane_count;
 static int plane_width[Y4M_MAX_NUM_PLANES];
 static int plane_height[Y4M_MAX_NUM_PLANES];
 static int plane_length[Y4M_MAX_NUM_PLANES];
-static uint8_t *input_planes[2][Y4M_MAX_NUM_PLANES];
-static uint8_t *output_planes[Y4M_MAX_NUM_PLANES];
-static uint8_t *work_lines[2];
+static int frame_length;
+static int use_lseek;
+static uint8_t *(*input_planes)[Y4M_MAX_NUM_PLANES];
+static uint8_t *(*output_ring)[Y4M_MAX_NUM_PLANES];
+static uint8_t **output_planes;
+static uint8_t *(*field_cache)[2][Y4M_MAX_NUM_PLANES] = NULL;
+static int (*field_cache_valid)[2] = NULL;
 static int input_frame_time;
 static int output_frame_time;
 static double frame_time_d;
 static int input_pos = 0;
 static int output_pos = 0;
+static int planned_frame_count = 0;
+static field_t planned_fields[2];
+static int planned_any = 0;
+static int planned_late_actions = 0;
+static int period_time = 0;
+static char *action_buffer = NULL;
+static int action_length = 0;
+static int action_size = 0;
+static sched_frame_t *schedule = NULL;
+static int schedule_frames = 0;
+static int schedule_loop = 0;
 static int buffer_frame_count = 0;
 static int buffer_frame_index[2] = { -1, -1 };
+static int input_slots = 2;
+static int input_head = 0;
+static int input_tail = 0;
+static int input_filled = 0;
+static int input_eof = 0;
+static int output_slots = 1;
+static int output_head = 0;
+static int output_tail = 0;
+static int output_filled = 0;
+static int output_done = 0;
+static int *output_repeat;
+static int repeat_frame_count = 0;
 static int input_frame_count = 0;
 static int output_frame_count = 0;
+static void (*blend_kernel)(uint8_t *dst, const uint8_t *src0,
+	const uint8_t *src1, int width, const blend_t *b);
+static void (*average_kernel)(uint8_t *dst, const uint8_t *src0,
+	const uint8_t *src1, int width);
+static const char *kernel_name;
+static pthread_t *workers;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static const field_t *pool_field = NULL;
+static const int *pool_fill = NULL;
+static int pool_generation = 0;
+static int pool_pending = 0;
+static pthread_t reader;
+static pthread_t writer;
+static pthread_mutex_t pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t input_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
 
 static void parse_options(int argc, char *argv[]);
 static void parse_ratio(y4m_ratio_t *ratio, const char *str);
 static int parse_interlacing(const char *str);
 static const char *get_interlace_mode(int interlacing);
 static int gcd(int a, int b);
-static int position_input(int output_pos);
+static void build_schedule(void);
+static void plan_frame(sched_frame_t *sf);
+static void plan_position(int output_pos);
+static void plan_step(void);
+static void add_action(char action);
+static int same_field(const field_t *a, const field_t *b);
+static void plan_field(field_t *f, int voffset, int step, int pos);
+static void print_schedule(void);
+static void describe_source(char *buf, const field_t *f, int i);
+static int run_actions(const char *actions);
 static void step_buffers(void);
 static int consume_input(void);
-static void produce_field(int voffset, int step, int pos);
-static void produce_source_line(uint8_t *dst, int srcframe, int srcfield, int p, int y);
+static int superseded(int output_pos);
+static int skip_input(void);
+static void discard_input(int length);
+static int read_input(int slot, y4m_frame_info_t *info);
+static void acquire_output(void);
+static void emit_output(void);
+static void repeat_output(void);
+static void write_output(uint8_t * const *planes);
+static void start_pipeline(void);
+static void stop_pipeline(void);
+static void *input_reader(void *arg);
+static void *output_writer(void *arg);
+static void produce_field(const field_t *f);
+static void produce_stripe(const field_t *f, const int fill[2], int stripe);
+static void start_workers(void);
+static void stop_workers(void);
+static void *field_worker(void *arg);
+static const uint8_t *source_line(int srcframe, int srcfield, int fill, int p, int y);
+static void select_kernels(void);
+static void init_blend(blend_t *b, int w0, int w1, int timediff);
+static void blend_line_div(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width, const blend_t *b);
+static void blend_line_c(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width, const blend_t *b);
+static void average_line_c(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width);
+#ifdef HAVE_X86_SIMD
+static void blend_line_sse2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width, const blend_t *b);
+static void blend_line_avx2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width, const blend_t *b);
+static void average_line_sse2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width);
+static void average_line_avx2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width);
+#endif
 
 int main(int argc, char *argv[]) {
 	y4m_ratio_t ratio;
@@ -189,22 +337,62 @@ int main(int argc, char *argv[]) {
 			fputs(PROGNAME ": error: unsupported chroma mode\n", stderr);
 			exit(1);
 		}
-		input_planes[0][i] = malloc(plane_length[i]);
-		input_planes[1][i] = malloc(plane_length[i]);
-		output_planes[i] = malloc(plane_length[i]);
-		if (input_planes[0][i] == NULL
-			|| input_planes[1][i] == NULL
-			|| output_planes[i] == NULL) {
+	}
+	frame_length = y4m_si_get_framelength(&input_si);
+	use_lseek = (lseek(STDIN_FILENO, 0, SEEK_CUR) != -1);
+	if (pipeline_frames > 0) {
+		input_slots = pipeline_frames + 2;
+		output_slots = pipeline_frames + 1;
+	}
+	input_planes = malloc(sizeof(uint8_t *[Y4M_MAX_NUM_PLANES]) * input_slots);
+	output_ring = malloc(sizeof(uint8_t *[Y4M_MAX_NUM_PLANES]) * output_slots);
+	output_repeat = calloc(output_slots, sizeof(int));
+	if (input_planes == NULL || output_ring == NULL || output_repeat == NULL) {
+		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+		exit(1);
+	}
+	for (i = 0; i < plane_count; i++) {
+		int j;
+		
+		for (j = 0; j < input_slots; j++) {
+			if ((input_planes[j][i] = malloc(plane_length[i])) == NULL) {
+				fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+				exit(1);
+			}
+		}
+		for (j = 0; j < output_slots; j++) {
+			if ((output_ring[j][i] = malloc(plane_length[i])) == NULL) {
+				fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+				exit(1);
+			}
+		}
+	}
+	
+	/* Interpolated field caches hold every other line of each plane */
+	if (input_interlacing != Y4M_ILACE_NONE) {
+		field_cache = malloc(sizeof(uint8_t *[2][Y4M_MAX_NUM_PLANES]) * input_slots);
+		field_cache_valid = calloc(input_slots, sizeof(int [2]));
+		if (field_cache == NULL || field_cache_valid == NULL) {
 			fputs(PROGNAME ": error: memory allocation failed\n", stderr);
 			exit(1);
 		}
+		for (i = 0; i < input_slots * 2 * plane_count; i++) {
+			int slot = i / (2 * plane_count);
+			int field = (i / plane_count) % 2;
+			int p = i % plane_count;
+			
+			field_cache[slot][field][p] = malloc(plane_width[p] * ((plane_height[p] + 1) / 2));
+			if (field_cache[slot][field][p] == NULL) {
+				fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+				exit(1);
+			}
+		}
 	}
-	work_lines[0] = malloc(y4m_si_get_width(&input_si));
-	work_lines[1] = malloc(y4m_si_get_width(&input_si));
-	if (work_lines[0] == NULL
-		|| work_lines[1] == NULL) {
-		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
-		exit(1);
+	start_workers();
+	select_kernels();
+	if (verbose & VERBOSE_DEBUG) {
+		fprintf(stderr, PROGNAME ": debug: using %s kernels\n",
+			kernel_name);
 	}
 	
 	/* Determine an exact (relative) frame time */
@@ -241,38 +429,63 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
+	/* Plan the resampling schedule */
+	build_schedule();
+	if (verbose & VERBOSE_DEBUG) {
+		print_schedule();
+	}
+	
 	/* Resample data */
+	start_pipeline();
+	i = 0;
 	while (1) {
+		sched_frame_t *sf;
+		
+		/* Determine the schedule for the output frame */
+		if (schedule_frames > 0) {
+			sf = schedule + i;
+			if (++i >= schedule_frames) {
+				i = schedule_loop;
+			}
+		} else {
+			sf = schedule;
+			plan_frame(sf);
+		}
+		
+		/* Write the previous frame again if nothing changed */
+		if (sf->repeat) {
+			repeat_output();
+			if (verbose & VERBOSE_DEBUG) {
+				fprintf(stderr, PROGNAME ": debug: repeated output frame %u\n",
+					output_frame_count);
+			}
+			output_frame_count++;
+			repeat_frame_count++;
+			continue;
+		}
 		
 		/* Produce the output frame */
-		if (!position_input(output_pos)) {
+		acquire_output();
+		if (!run_actions(sf->actions[0])) {
 			break;
 		}
-		if (output_interlacing == Y4M_ILACE_NONE) {
-			produce_field(0, 1, output_pos);
-		} else {
-			produce_field(output_interlacing == Y4M_ILACE_TOP_FIRST ? 0 : 1, 2,
-				output_pos);
-			if (!position_input(output_pos + output_frame_time / 2)) {
+		produce_field(&sf->fields[0]);
+		if (output_interlacing != Y4M_ILACE_NONE) {
+			if (!run_actions(sf->actions[1])) {
 				break;
 			}
-			produce_field(output_interlacing == Y4M_ILACE_TOP_FIRST ? 1 : 0, 2,
-				output_pos + output_frame_time / 2);
+			produce_field(&sf->fields[1]);
 		}
 		
 		/* Write the finished output frame out */
-		y4m_clear_frame_info(&fi);
-		if (y4m_write_frame(STDOUT_FILENO, &output_si, &fi, output_planes) != Y4M_OK) {
-			fputs(PROGNAME ": error: could not write output stream\n", stderr);
-			exit(1);
-		}
+		emit_output();
 		if (verbose & VERBOSE_DEBUG) {
 			fprintf(stderr, PROGNAME ": debug: produced output frame %u\n",
 				output_frame_count);
 		}
 		output_frame_count++;
-		output_pos += output_frame_time;
 	}
+	stop_pipeline();
 
 	/* Print some information if verbose enabled */
 	if (verbose) {
@@ -280,6 +493,9 @@ int main(int argc, char *argv[]) {
 			PROGNAME
 			": info: produced %u output frames from %u input frames\n",
 			output_frame_count, input_frame_count);
+		fprintf(stderr,
+			PROGNAME ": info: %u output frames were repeated\n",
+			repeat_frame_count);
 		fprintf(stderr,
 			PROGNAME
 			": info: input and output length difference %.4f s\n",
@@ -289,6 +505,7 @@ int main(int argc, char *argv[]) {
 	}
 	
 	/* Finalize */
+	stop_workers();
 	y4m_fini_frame_info(&fi);
 	y4m_fini_stream_info(&output_si);
 	y4m_fini_stream_info(&input_si);
@@ -301,7 +518,7 @@ static void parse_options(int argc, char *argv[]) {
 	int c;
 
 	/* Read options */	
-	while ((c = getopt(argc, argv, "dF:f:hI:i:m:v")) != -1) {
+	while ((c = getopt(argc, argv, "dF:f:hI:i:m:p:t:v")) != -1) {
 		switch (c) {
 			case 'h':
 				fputs(
@@ -329,6 +546,9 @@ COPYRIGHT "\n"
 "  -m M     source frame selection mode (defaults to 'a')\n"
 "             c - the closest input frame/field\n"
 "             a - weighted average of the two closest input frames/fields\n"
+"  -t N     number of threads used to produce output fields (default is 1)\n"
+"  -p N     read, resample and write in separate threads, buffering up to\n"
+"             N frames of input and output\n"
 "  -v       verbose operation\n"
 "  -d       enable debug output\n",
 					stdout);
@@ -367,6 +587,24 @@ COPYRIGHT "\n"
 					exit(1);
 				}
 				break;
+			case 'p':
+				pipeline_frames = atoi(optarg);
+				if (pipeline_frames <= 0) {
+					fprintf(stderr,
+						PROGNAME ": error: invalid pipeline buffer size %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case 't':
+				thread_count = atoi(optarg);
+				if (thread_count <= 0) {
+					fprintf(stderr,
+						PROGNAME ": error: invalid number of threads %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
 			case 'v':
 				verbose |= 1;
 				break;
@@ -407,6 +645,11 @@ COPYRIGHT "\n"
 		}
 		fprintf(stderr, PROGNAME ": conf: sampling mode %s\n",
 			(sampling_mode == SAMPLING_CLOSEST ? "closest" : "weighted average"));
+		fprintf(stderr, PROGNAME ": conf: %u threads\n", thread_count);
+		if (pipeline_frames > 0) {
+			fprintf(stderr, PROGNAME ": conf: pipelined with %u frame buffers\n",
+				pipeline_frames);
+		}
 	}
 }
 
@@ -456,85 +699,205 @@ static int gcd(int a, int b) {
 	}
 }
 
-static int position_input(int output_pos) {
+/*
+ * Precomputes the input actions and output field parameters for each output
+ * frame. The input and output frame times are integers so the schedule is
+ * periodic after the first frames, and the main loop cycles through the
+ * period. If the period is too long, or no repeating state is found, the
+ * planner state is restored and the schedule is planned frame by frame.
+ */
+static void build_schedule(void) {
+	long long period_t = (long long) input_frame_time / gcd(input_frame_time, output_frame_time) * output_frame_time;
+	long long period = period_t / output_frame_time;
+	int saved_input_pos = input_pos;
+	int saved_output_pos = output_pos;
+	int saved_frame_count = planned_frame_count;
+	field_t saved_fields[2];
+	int saved_any = planned_any;
+	int saved_late_actions = planned_late_actions;
+	int size = 0;
+	int n;
+	
+	memcpy(saved_fields, planned_fields, sizeof(saved_fields));
+	if (period_t <= 0x7fffffff) {
+		period_time = (int) period_t;
+	}
+	if (period <= SCHEDULE_MAX_FRAMES) {
+		for (n = 0; n < 3 * period + 2; n++) {
+			sched_frame_t *sf;
+			
+			if (n >= size) {
+				size = (size > 0 ? 2 * size : 16);
+				if ((schedule = realloc(schedule, sizeof(sched_frame_t) * size)) == NULL) {
+					fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+					exit(1);
+				}
+			}
+			sf = schedule + n;
+			sf->actions[0] = sf->actions[1] = NULL;
+			plan_frame(sf);
+			
+			/* Found the period if the state repeats */
+			if (n >= period
+				&& sf->offset == schedule[n - period].offset
+				&& sf->buffered == schedule[n - period].buffered
+				&& sf->repeat == schedule[n - period].repeat) {
+				free(sf->actions[0]);
+				free(sf->actions[1]);
+				schedule_frames = n;
+				schedule_loop = n - (int) period;
+				return;
+			}
+		}
+		for (n--; n >= 0; n--) {
+			free(schedule[n].actions[0]);
+			free(schedule[n].actions[1]);
+		}
+		input_pos = saved_input_pos;
+		output_pos = saved_output_pos;
+		planned_frame_count = saved_frame_count;
+		memcpy(planned_fields, saved_fields, sizeof(saved_fields));
+		planned_any = saved_any;
+		planned_late_actions = saved_late_actions;
+	}
+	
+	/* Plan on the fly using a single entry */
+	if ((schedule = realloc(schedule, sizeof(sched_frame_t))) == NULL) {
+		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+		exit(1);
+	}
+	schedule->actions[0] = schedule->actions[1] = NULL;
+	schedule_frames = 0;
+}
+
+/* Plans the next output frame, advancing the planner state */
+static void plan_frame(sched_frame_t *sf) {
+	int f;
+	
+	sf->offset = output_pos - input_pos;
+	sf->buffered = planned_frame_count;
+	sf->repeat = planned_any && !planned_late_actions;
+	for (f = 0; f < (output_interlacing == Y4M_ILACE_NONE ? 1 : 2); f++) {
+		int pos = output_pos + f * output_frame_time / 2;
+		
+		action_length = 0;
+		plan_position(pos);
+		add_action('\0');
+		free(sf->actions[f]);
+		if ((sf->actions[f] = malloc(action_length)) == NULL) {
+			fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+			exit(1);
+		}
+		memcpy(sf->actions[f], action_buffer, action_length);
+		if (output_interlacing == Y4M_ILACE_NONE) {
+			plan_field(&sf->fields[f], 0, 1, pos);
+		} else {
+			plan_field(&sf->fields[f], (output_interlacing == Y4M_ILACE_TOP_FIRST) == (f == 0) ? 0 : 1, 2, pos);
+		}
+		if (sf->actions[f][0] != '\0' || !same_field(&sf->fields[f], &planned_fields[f])) {
+			sf->repeat = 0;
+		}
+		planned_fields[f] = sf->fields[f];
+	}
+	planned_any = 1;
+	planned_late_actions = (output_interlacing != Y4M_ILACE_NONE
+		&& sf->actions[1][0] != '\0');
+	output_pos += output_frame_time;
+	
+	/* Keep the positions bounded */
+	if (period_time > 0 && input_pos >= period_time && output_pos >= period_time) {
+		input_pos -= period_time;
+		output_pos -= period_time;
+	}
+}
+
+static void plan_position(int output_pos) {
 	switch (sampling_mode) {
 		case SAMPLING_CLOSEST:
-			while (buffer_frame_count == 0
-				|| abs(input_pos + (input_interlacing != Y4M_ILACE_NONE ? input_frame_time / 2 : 0) - output_pos)
-					> abs(input_pos + input_frame_time - output_pos)) {
-				assert(buffer_frame_count <= 1);
-				if (buffer_frame_count == 1) {
-					step_buffers();
+			while (planned_frame_count == 0 || superseded(output_pos)) {
+				assert(planned_frame_count <= 1);
+				if (planned_frame_count == 1) {
+					plan_step();
 				}
-				if (!consume_input()) {
-					return 0;
+				
+				/*
+				 * Frames superseded by the next frame are not needed for
+				 * this or any later output field so skip their data
+				 */
+				while (superseded(output_pos)) {
+					add_action(ACTION_SKIP);
+					input_pos += input_frame_time;
 				}
+				add_action(ACTION_READ);
+				planned_frame_count++;
 			}
-			return 1;
+			break;
 		case SAMPLING_AVERAGE:
-			while (buffer_frame_count == 0
+			while (planned_frame_count == 0
 				|| input_pos + input_frame_time <= output_pos
-				|| (buffer_frame_count < 2
+				|| (planned_frame_count < 2
 					&& (input_interlacing != Y4M_ILACE_NONE ? input_pos + input_frame_time / 2 < output_pos : input_pos != output_pos))) {
-				assert(buffer_frame_count <= 2);
-				if (buffer_frame_count == 2) {
-					step_buffers();
-				} else if (!consume_input()) {
-					return 0;
+				assert(planned_frame_count <= 2);
+				if (planned_frame_count == 2) {
+					plan_step();
+				} else {
+					add_action(ACTION_READ);
+					planned_frame_count++;
 				}
 			}
-			return 1;
+			break;
 		default:
 			assert(0);
 			exit(1);
 	}
 }
 
-static void step_buffers(void) {
-	assert(buffer_frame_count > 0 && buffer_frame_count <= 2);
-	buffer_frame_count--;
-	if (buffer_frame_count == 1) {
-		buffer_frame_index[0] = buffer_frame_index[1];
-	}
-	buffer_frame_index[buffer_frame_count] = -1;
+static void plan_step(void) {
+	add_action(ACTION_STEP);
+	planned_frame_count--;
 	input_pos += input_frame_time;
 }
 
-static int consume_input(void) {
-	int i;
-	assert(buffer_frame_count <= 2);
-	if (buffer_frame_count == 2) {
-		step_buffers();
-	}
-	if (buffer_frame_count > 0) {
-		buffer_frame_index[1] = 1 - buffer_frame_index[0];
-	} else {
-		buffer_frame_index[0] = 0;
-	}
-	if ((i = y4m_read_frame(STDIN_FILENO, &input_si, &fi, input_planes[buffer_frame_index[buffer_frame_count]])) == Y4M_OK) {
-		buffer_frame_count++;
-		if (verbose & VERBOSE_DEBUG) {
-			fprintf(stderr, PROGNAME ": debug: consumed input frame %u (%u frames buffered)\n",
-				input_frame_count, buffer_frame_count);
+static void add_action(char action) {
+	if (action_length >= action_size) {
+		action_size = (action_size > 0 ? 2 * action_size : 16);
+		if ((action_buffer = realloc(action_buffer, action_size)) == NULL) {
+			fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+			exit(1);
 		}
-		input_frame_count++;
-		return 1;
-	} else if (i == Y4M_ERR_EOF) {
-		return 0;
-	} else {
-		fputs(PROGNAME ": error: could not read input stream\n", stderr);
-		exit(1);
 	}
+	action_buffer[action_length++] = action;
 }
 
-static void produce_field(int voffset, int step, int pos) {
-	int p;
-	int srcframe[2] = { -1, -1 };
-	int srcfield[2] = { -1, -1 };
+/* Whether two fields are produced identically from the same buffered frames */
+static int same_field(const field_t *a, const field_t *b) {
+	return a->srcframe[0] == b->srcframe[0]
+		&& a->srcframe[1] == b->srcframe[1]
+		&& a->srcfield[0] == b->srcfield[0]
+		&& a->srcfield[1] == b->srcfield[1]
+		&& (a->srcframe[1] == -1
+			|| (a->blend.w[0] == b->blend.w[0]
+				&& a->blend.w[1] == b->blend.w[1]));
+}
+
+/* Whether the next input frame is closer to the output position than the current one */
+static int superseded(int output_pos) {
+	return abs(input_pos + (input_interlacing != Y4M_ILACE_NONE ? input_frame_time / 2 : 0) - output_pos)
+		> abs(input_pos + input_frame_time - output_pos);
+}
+
+static void plan_field(field_t *f, int voffset, int step, int pos) {
+	int *srcframe = f->srcframe;
+	int *srcfield = f->srcfield;
 	int srctime[2] = { 0, 0 };
 	int timediff = 0;
 	int w[2] = { 0, 0 };
 	
+	f->voffset = voffset;
+	f->step = step;
+	srcframe[0] = srcframe[1] = -1;
+	srcfield[0] = srcfield[1] = -1;
+	
 	switch (sampling_mode) {
 		case SAMPLING_CLOSEST:
 			srcframe[0] = 0;
@@ -575,50 +938,678 @@ static void produce_field(int voffset, int step, int pos) {
 				timediff = srctime[1] - srctime[0];
 				w[0] = timediff - (pos - srctime[0]);
 				w[1] = timediff - (srctime[1] - pos);
+				init_blend(&f->blend, w[0], w[1], timediff);
 			}
 			break;
-	}	
+	}
+}
+
+static void print_schedule(void) {
+	int n;
+	
+	if (schedule_frames == 0) {
+		fputs(PROGNAME ": debug: schedule period too long, planning on the fly\n",
+			stderr);
+		return;
+	}
+	fprintf(stderr,
+		PROGNAME ": debug: schedule of %u output frames repeating from frame %u\n",
+		schedule_frames, schedule_loop);
+	fputs(PROGNAME ": debug: schedule actions: R = read, K = skip, S = step\n",
+		stderr);
+	for (n = 0; n < schedule_frames; n++) {
+		int f;
+		
+		for (f = 0; f < (output_interlacing == Y4M_ILACE_NONE ? 1 : 2); f++) {
+			char src[2][64];
+			
+			describe_source(src[0], &schedule[n].fields[f], 0);
+			describe_source(src[1], &schedule[n].fields[f], 1);
+			fprintf(stderr,
+				PROGNAME ": debug: schedule frame %u field %u: actions %-4s source %s%s%s\n",
+				n, f, schedule[n].actions[f], src[0],
+				(src[1][0] != '\0' ? " + " : ""), src[1]);
+		}
+	}
+}
+
+static void describe_source(char *buf, const field_t *f, int i) {
+	int n;
+	
+	buf[0] = '\0';
+	if (f->srcframe[i] == -1) {
+		return;
+	}
+	n = sprintf(buf, "%u", f->srcframe[i]);
+	if (f->srcfield[i] != -1) {
+		n += sprintf(buf + n, "%c", f->srcfield[i] ? 'b' : 't');
+	}
+	if (f->srcframe[1] != -1) {
+		sprintf(buf + n, " * %u/%u", f->blend.w[i], f->blend.timediff);
+	}
+}
+
+static int run_actions(const char *actions) {
+	for (; *actions != '\0'; actions++) {
+		switch (*actions) {
+			case ACTION_READ:
+				if (!consume_input()) {
+					return 0;
+				}
+				break;
+			case ACTION_SKIP:
+				if (!skip_input()) {
+					return 0;
+				}
+				break;
+			case ACTION_STEP:
+				step_buffers();
+				break;
+		}
+	}
+	return 1;
+}
+
+static void step_buffers(void) {
+	assert(buffer_frame_count > 0 && buffer_frame_count <= 2);
+	buffer_frame_count--;
+	if (buffer_frame_count == 1) {
+		buffer_frame_index[0] = buffer_frame_index[1];
+	}
+	buffer_frame_index[buffer_frame_count] = -1;
+	
+	/* Release the oldest input slot */
+	if (field_cache_valid != NULL) {
+		field_cache_valid[input_tail][0] = 0;
+		field_cache_valid[input_tail][1] = 0;
+	}
+	if (++input_tail >= input_slots) {
+		input_tail = 0;
+	}
+	if (pipeline_frames > 0) {
+		pthread_mutex_lock(&pipe_mutex);
+		input_filled--;
+		pthread_cond_broadcast(&input_cond);
+		pthread_mutex_unlock(&pipe_mutex);
+	}
+}
+
+static int consume_input(void) {
+	int slot;
+	assert(buffer_frame_count <= 2);
+	if (buffer_frame_count == 2) {
+		step_buffers();
+	}
+	slot = (input_tail + buffer_frame_count) % input_slots;
+	if (pipeline_frames > 0) {
+		int available;
+		
+		pthread_mutex_lock(&pipe_mutex);
+		while (input_filled <= buffer_frame_count && !input_eof) {
+			pthread_cond_wait(&input_cond, &pipe_mutex);
+		}
+		available = (input_filled > buffer_frame_count);
+		pthread_mutex_unlock(&pipe_mutex);
+		if (!available) {
+			return 0;
+		}
+	} else if (!read_input(slot, &fi)) {
+		return 0;
+	}
+	buffer_frame_index[buffer_frame_count] = slot;
+	buffer_frame_count++;
+	if (verbose & VERBOSE_DEBUG) {
+		fprintf(stderr, PROGNAME ": debug: consumed input frame %u (%u frames buffered)\n",
+			input_frame_count, buffer_frame_count);
+	}
+	input_frame_count++;
+	return 1;
+}
+
+static int skip_input(void) {
+	int i;
+	assert(buffer_frame_count == 0);
+	if (pipeline_frames > 0) {
+		if (!consume_input()) {
+			return 0;
+		}
+		step_buffers();
+		return 1;
+	}
+	if ((i = y4m_read_frame_header(STDIN_FILENO, &input_si, &fi)) == Y4M_ERR_EOF) {
+		return 0;
+	} else if (i != Y4M_OK) {
+		fputs(PROGNAME ": error: could not read input stream\n", stderr);
+		exit(1);
+	}
+	if (use_lseek) {
+		if (lseek(STDIN_FILENO, frame_length, SEEK_CUR) == -1) {
+			fputs(PROGNAME ": error: could not seek input stream\n", stderr);
+			exit(1);
+		}
+	} else {
+		discard_input(frame_length);
+	}
+	if (verbose & VERBOSE_DEBUG) {
+		fprintf(stderr, PROGNAME ": debug: skipped input frame %u\n",
+			input_frame_count);
+	}
+	input_frame_count++;
+	return 1;
+}
+
+static void discard_input(int length) {
+	static uint8_t scratch[DISCARD_CHUNK];
+	
+	while (length > 0) {
+		int n = (length < DISCARD_CHUNK ? length : DISCARD_CHUNK);
+		if (y4m_read(STDIN_FILENO, scratch, n) != 0) {
+			fputs(PROGNAME ": error: could not read input stream\n", stderr);
+			exit(1);
+		}
+		length -= n;
+	}
+}
+
+static int read_input(int slot, y4m_frame_info_t *info) {
+	int i;
+	if ((i = y4m_read_frame(STDIN_FILENO, &input_si, info, input_planes[slot])) == Y4M_OK) {
+		return 1;
+	} else if (i == Y4M_ERR_EOF) {
+		return 0;
+	} else {
+		fputs(PROGNAME ": error: could not read input stream\n", stderr);
+		exit(1);
+	}
+}
+
+static void acquire_output(void) {
+	if (pipeline_frames > 0) {
+		pthread_mutex_lock(&pipe_mutex);
+		while (output_filled == output_slots) {
+			pthread_cond_wait(&output_cond, &pipe_mutex);
+		}
+		pthread_mutex_unlock(&pipe_mutex);
+	}
+	output_planes = output_ring[output_head];
+}
+
+static void emit_output(void) {
+	if (pipeline_frames > 0) {
+		pthread_mutex_lock(&pipe_mutex);
+		output_repeat[output_head] = 1;
+		if (++output_head >= output_slots) {
+			output_head = 0;
+		}
+		output_filled++;
+		pthread_cond_broadcast(&output_cond);
+		pthread_mutex_unlock(&pipe_mutex);
+	} else {
+		write_output(output_planes);
+	}
+}
+
+/*
+ * Writes the previous output frame again. Without pipelining it is still in
+ * the only output slot. Otherwise the writer is told to write the newest
+ * slot once more; it keeps the last written slot until a newer one exists.
+ */
+static void repeat_output(void) {
+	if (pipeline_frames > 0) {
+		pthread_mutex_lock(&pipe_mutex);
+		output_repeat[(output_head + output_slots - 1) % output_slots]++;
+		pthread_cond_broadcast(&output_cond);
+		pthread_mutex_unlock(&pipe_mutex);
+	} else {
+		write_output(output_planes);
+	}
+}
+
+/*
+ * Writes a frame header and the planes with a single gathered write. The
+ * frame info is always empty so the header is the plain frame magic.
+ */
+static void write_output(uint8_t * const *planes) {
+	static char header[] = Y4M_FRAME_MAGIC "\n";
+	struct iovec iov[Y4M_MAX_NUM_PLANES + 1];
+	int count = plane_count + 1;
+	int first = 0;
+	int i;
+	
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header) - 1;
+	for (i = 0; i < plane_count; i++) {
+		iov[i + 1].iov_base = planes[i];
+		iov[i + 1].iov_len = plane_length[i];
+	}
+	while (first < count) {
+		ssize_t n = writev(STDOUT_FILENO, iov + first, count - first);
+		
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fputs(PROGNAME ": error: could not write output stream\n", stderr);
+			exit(1);
+		}
+		while (first < count && (size_t) n >= iov[first].iov_len) {
+			n -= iov[first].iov_len;
+			first++;
+		}
+		if (first < count) {
+			iov[first].iov_base = (char *) iov[first].iov_base + n;
+			iov[first].iov_len -= n;
+		}
+	}
+}
+
+static void start_pipeline(void) {
+	if (pipeline_frames <= 0) {
+		return;
+	}
+	if (pthread_create(&reader, NULL, input_reader, NULL) != 0
+		|| pthread_create(&writer, NULL, output_writer, NULL) != 0) {
+		fputs(PROGNAME ": error: could not create a pipeline thread\n", stderr);
+		exit(1);
+	}
+}
+
+/* Waits for the writer to drain the output buffers */
+static void stop_pipeline(void) {
+	if (pipeline_frames <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&pipe_mutex);
+	output_done = 1;
+	pthread_cond_broadcast(&output_cond);
+	pthread_mutex_unlock(&pipe_mutex);
+	pthread_join(writer, NULL);
+	pthread_join(reader, NULL);
+}
+
+static void *input_reader(void *arg) {
+	y4m_frame_info_t info;
+	int more;
+	
+	(void) arg;
+	y4m_init_frame_info(&info);
+	do {
+		pthread_mutex_lock(&pipe_mutex);
+		while (input_filled == input_slots) {
+			pthread_cond_wait(&input_cond, &pipe_mutex);
+		}
+		pthread_mutex_unlock(&pipe_mutex);
+		more = read_input(input_head, &info);
+		pthread_mutex_lock(&pipe_mutex);
+		if (more) {
+			if (++input_head >= input_slots) {
+				input_head = 0;
+			}
+			input_filled++;
+		} else {
+			input_eof = 1;
+		}
+		pthread_cond_broadcast(&input_cond);
+		pthread_mutex_unlock(&pipe_mutex);
+	} while (more);
+	y4m_fini_frame_info(&info);
+	return NULL;
+}
+
+static void *output_writer(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&pipe_mutex);
+	while (1) {
+		if (output_repeat[output_tail] > 0) {
+			
+			/* Write the current slot (again) */
+			output_repeat[output_tail]--;
+			pthread_mutex_unlock(&pipe_mutex);
+			write_output(output_ring[output_tail]);
+			pthread_mutex_lock(&pipe_mutex);
+		} else if (output_filled > 1) {
+			
+			/* Release the written slot as a newer one exists */
+			if (++output_tail >= output_slots) {
+				output_tail = 0;
+			}
+			output_filled--;
+			pthread_cond_broadcast(&output_cond);
+		} else if (output_done) {
+			break;
+		} else {
+			pthread_cond_wait(&output_cond, &pipe_mutex);
+		}
+	}
+	pthread_mutex_unlock(&pipe_mutex);
+	return NULL;
+}
+
+static void produce_field(const field_t *f) {
+	int fill[2] = { 0, 0 };
+	int i;
+	
+	/* Interpolate source fields which are not cached yet */
+	for (i = 0; i < 2; i++) {
+		if (field_cache != NULL && f->srcframe[i] != -1
+			&& (f->step == 1 || f->voffset != f->srcfield[i])) {
+			fill[i] = !field_cache_valid[buffer_frame_index[f->srcframe[i]]][f->srcfield[i]];
+		}
+	}
+	if (fill[0] && fill[1]
+		&& f->srcframe[0] == f->srcframe[1] && f->srcfield[0] == f->srcfield[1]) {
+		fill[1] = 0;
+	}
+	
+	/* Produce the field, split into stripes if multi-threaded */
+	if (thread_count > 1) {
+		pthread_mutex_lock(&pool_mutex);
+		pool_field = f;
+		pool_fill = fill;
+		pool_pending = thread_count - 1;
+		pool_generation++;
+		pthread_cond_broadcast(&pool_start);
+		pthread_mutex_unlock(&pool_mutex);
+		produce_stripe(f, fill, 0);
+		pthread_mutex_lock(&pool_mutex);
+		while (pool_pending > 0) {
+			pthread_cond_wait(&pool_done, &pool_mutex);
+		}
+		pthread_mutex_unlock(&pool_mutex);
+	} else {
+		produce_stripe(f, fill, 0);
+	}
+	
+	/* All interpolated lines of the filled fields are now cached */
+	for (i = 0; i < 2; i++) {
+		if (fill[i]) {
+			field_cache_valid[buffer_frame_index[f->srcframe[i]]][f->srcfield[i]] = 1;
+		}
+	}
+}
+
+/*
+ * Produces the given stripe of each plane of an output field. The field rows
+ * of each plane are split evenly into thread_count stripes.
+ */
+static void produce_stripe(const field_t *f, const int fill[2], int stripe) {
+	int p;
+	
 	for (p = 0; p < plane_count; p++) {
-		int y;
-		for (y = voffset; y < plane_height[p]; y += step) {
-			switch (sampling_mode) {
-				case SAMPLING_CLOSEST:
-					produce_source_line(output_planes[p] + y * plane_width[p], srcframe[0], srcfield[0], p, y);
-					break;
-				case SAMPLING_AVERAGE:
-					if (srcframe[1] == -1) {
-						produce_source_line(output_planes[p] + y * plane_width[p], srcframe[0], srcfield[0], p, y);
-					} else {
-						int x;
-						
-						produce_source_line(work_lines[0], srcframe[0], srcfield[0], p, y);
-						produce_source_line(work_lines[1], srcframe[1], srcfield[1], p, y);						
-						for (x = 0; x < plane_width[p]; x++) {
-							*(output_planes[p] + y * plane_width[p] + x)
-								= (uint8_t) ((w[0] * work_lines[0][x] + w[1] * work_lines[1][x]) / timediff);
-						}
-					}
-					break;
+		int rows = (plane_height[p] - f->voffset + f->step - 1) / f->step;
+		int y = f->voffset + f->step * (int) ((long) rows * stripe / thread_count);
+		int end = f->voffset + f->step * (int) ((long) rows * (stripe + 1) / thread_count);
+		
+		for (; y < end; y += f->step) {
+			uint8_t *dst = output_planes[p] + y * plane_width[p];
+			
+			if (f->srcframe[1] == -1) {
+				memcpy(dst, source_line(f->srcframe[0], f->srcfield[0], fill[0], p, y),
+					plane_width[p]);
+			} else {
+				f->blend.kernel(dst,
+					source_line(f->srcframe[0], f->srcfield[0], fill[0], p, y),
+					source_line(f->srcframe[1], f->srcfield[1], fill[1], p, y),
+					plane_width[p], &f->blend);
 			}
 		}
 	}
 }
 
-static void produce_source_line(uint8_t *dst, int srcframe, int srcfield, int p, int y) {
+static void start_workers(void) {
+	int i;
+	
+	if (thread_count <= 1) {
+		return;
+	}
+	workers = malloc(sizeof(pthread_t) * (thread_count - 1));
+	if (workers == NULL) {
+		fputs(PROGNAME ": error: memory allocation failed\n", stderr);
+		exit(1);
+	}
+	for (i = 1; i < thread_count; i++) {
+		if (pthread_create(&workers[i - 1], NULL, field_worker, (void *) (intptr_t) i) != 0) {
+			fputs(PROGNAME ": error: could not create a worker thread\n", stderr);
+			exit(1);
+		}
+	}
+}
+
+static void stop_workers(void) {
+	int i;
+	
+	if (thread_count <= 1) {
+		return;
+	}
+	pthread_mutex_lock(&pool_mutex);
+	pool_field = NULL;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_start);
+	pthread_mutex_unlock(&pool_mutex);
+	for (i = 1; i < thread_count; i++) {
+		pthread_join(workers[i - 1], NULL);
+	}
+	free(workers);
+}
+
+static void *field_worker(void *arg) {
+	int stripe = (int) (intptr_t) arg;
+	int generation = 0;
+	
+	while (1) {
+		const field_t *f;
+		const int *fill;
+		
+		pthread_mutex_lock(&pool_mutex);
+		while (pool_generation == generation) {
+			pthread_cond_wait(&pool_start, &pool_mutex);
+		}
+		generation = pool_generation;
+		f = pool_field;
+		fill = pool_fill;
+		pthread_mutex_unlock(&pool_mutex);
+		if (f == NULL) {
+			break;
+		}
+		produce_stripe(f, fill, stripe);
+		pthread_mutex_lock(&pool_mutex);
+		if (--pool_pending == 0) {
+			pthread_cond_signal(&pool_done);
+		}
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	return NULL;
+}
+
+/*
+ * Returns the source line for the specified plane and row. Lines present in
+ * the source field are returned in place from the input buffer. Missing
+ * lines are interpolated into the field cache of the input slot if fill is
+ * set, otherwise they are already there.
+ */
+static const uint8_t *source_line(int srcframe, int srcfield, int fill, int p, int y) {
+	int slot = buffer_frame_index[srcframe];
+	const uint8_t *plane = input_planes[slot][p];
+	
 	if (input_interlacing == Y4M_ILACE_NONE
 		|| (srcfield ? (y & 1) : !(y & 1))) {
-		memcpy(dst, input_planes[buffer_frame_index[srcframe]][p] + y * plane_width[p], plane_width[p]);
+		return plane + y * plane_width[p];
+	} else if (y == 0) {
+		return plane + plane_width[p];
+	} else if (y == plane_height[p] - 1) {
+		return plane + (y - 1) * plane_width[p];
 	} else {
-		if (y == 0) {
-			memcpy(dst, input_planes[buffer_frame_index[srcframe]][p] + plane_width[p], plane_width[p]);
-		} else if (y == plane_height[p] - 1) {
-			memcpy(dst, input_planes[buffer_frame_index[srcframe]][p] + (y - 1) * plane_width[p], plane_width[p]);
-		} else {
-			uint8_t *l = input_planes[buffer_frame_index[srcframe]][p] + (y - 1) * plane_width[p];
-			int x;
-			for (x = 0; x < plane_width[p]; x++) {
-				dst[x] = (uint8_t) (((int) l[x] + (l + 2 * plane_width[p])[x]) / 2);
-			}
+		uint8_t *l = field_cache[slot][srcfield][p] + (y >> 1) * plane_width[p];
+		if (fill) {
+			average_kernel(l, plane + (y - 1) * plane_width[p],
+				plane + (y + 1) * plane_width[p], plane_width[p]);
 		}
+		return l;
+	}
+}
+
+static void select_kernels(void) {
+	blend_kernel = blend_line_c;
+	average_kernel = average_line_c;
+	kernel_name = "scalar";
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		blend_kernel = blend_line_avx2;
+		average_kernel = average_line_avx2;
+		kernel_name = "AVX2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		blend_kernel = blend_line_sse2;
+		average_kernel = average_line_sse2;
+		kernel_name = "SSE2";
+	}
+#endif
+}
+
+/*
+ * Prepares blending with weights w0 and w1 (w0 + w1 == timediff). The
+ * division by timediff is replaced by multiplication with mul and a right
+ * shift. Choosing 2^shift >= 255 * timediff^2 makes the result exact for
+ * all numerators up to 255 * timediff, i.e. bit-exact with the division.
+ */
+static void init_blend(blend_t *b, int w0, int w1, int timediff) {
+	uint64_t limit;
+
+	b->w[0] = w0;
+	b->w[1] = w1;
+	b->timediff = timediff;
+	if (timediff > BLEND_MAX_TIMEDIFF) {
+		b->mul = 0;
+		b->shift = 0;
+		b->kernel = blend_line_div;
+		return;
+	}
+	limit = (uint64_t) 255 * timediff * timediff;
+	for (b->shift = 0; ((uint64_t) 1 << b->shift) < limit; b->shift++);
+	b->mul = (uint32_t) ((((uint64_t) 1 << b->shift) + timediff - 1) / timediff);
+	b->kernel = blend_kernel;
+}
+
+static void blend_line_div(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width, const blend_t *b) {
+	int x;
+	for (x = 0; x < width; x++) {
+		dst[x] = (uint8_t) ((b->w[0] * src0[x] + b->w[1] * src1[x]) / b->timediff);
+	}
+}
+
+static void blend_line_c(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width, const blend_t *b) {
+	int x;
+	for (x = 0; x < width; x++) {
+		uint32_t n = b->w[0] * src0[x] + b->w[1] * src1[x];
+		dst[x] = (uint8_t) (((uint64_t) n * b->mul) >> b->shift);
+	}
+}
+
+/* Averages two lines rounding down */
+static void average_line_c(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width) {
+	int x;
+	for (x = 0; x < width; x++) {
+		dst[x] = (uint8_t) (((int) src0[x] + src1[x]) / 2);
 	}
 }
+
+#ifdef HAVE_X86_SIMD
+
+/* Divides four 32-bit numerators using the fixed-point reciprocal */
+__attribute__((target("sse2")))
+static inline __m128i blend_div_sse2(__m128i n, __m128i mul, __m128i shift) {
+	__m128i even = _mm_srl_epi64(_mm_mul_epu32(n, mul), shift);
+	__m128i odd = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(n, 32), mul), shift);
+	return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+__attribute__((target("sse2")))
+static void blend_line_sse2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width, const blend_t *b) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi32((b->w[1] << 16) | b->w[0]);
+	const __m128i mul = _mm_set1_epi32((int) b->mul);
+	const __m128i shift = _mm_cvtsi32_si128(b->shift);
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i s0 = _mm_loadu_si128((const __m128i *) (src0 + x));
+		__m128i s1 = _mm_loadu_si128((const __m128i *) (src1 + x));
+		__m128i s0l = _mm_unpacklo_epi8(s0, zero);
+		__m128i s0h = _mm_unpackhi_epi8(s0, zero);
+		__m128i s1l = _mm_unpacklo_epi8(s1, zero);
+		__m128i s1h = _mm_unpackhi_epi8(s1, zero);
+		__m128i q0 = blend_div_sse2(_mm_madd_epi16(_mm_unpacklo_epi16(s0l, s1l), w), mul, shift);
+		__m128i q1 = blend_div_sse2(_mm_madd_epi16(_mm_unpackhi_epi16(s0l, s1l), w), mul, shift);
+		__m128i q2 = blend_div_sse2(_mm_madd_epi16(_mm_unpacklo_epi16(s0h, s1h), w), mul, shift);
+		__m128i q3 = blend_div_sse2(_mm_madd_epi16(_mm_unpackhi_epi16(s0h, s1h), w), mul, shift);
+		_mm_storeu_si128((__m128i *) (dst + x),
+			_mm_packus_epi16(_mm_packs_epi32(q0, q1), _mm_packs_epi32(q2, q3)));
+	}
+	blend_line_c(dst + x, src0 + x, src1 + x, width - x, b);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_div_avx2(__m256i n, __m256i mul, __m128i shift) {
+	__m256i even = _mm256_srl_epi64(_mm256_mul_epu32(n, mul), shift);
+	__m256i odd = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(n, 32), mul), shift);
+	return _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+}
+
+/* Unpacking and packing both work within 128-bit lanes so no permutes needed */
+__attribute__((target("avx2")))
+static void blend_line_avx2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width, const blend_t *b) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i w = _mm256_set1_epi32((b->w[1] << 16) | b->w[0]);
+	const __m256i mul = _mm256_set1_epi32((int) b->mul);
+	const __m128i shift = _mm_cvtsi32_si128(b->shift);
+	int x;
+
+	for (x = 0; x + 32 <= width; x += 32) {
+		__m256i s0 = _mm256_loadu_si256((const __m256i *) (src0 + x));
+		__m256i s1 = _mm256_loadu_si256((const __m256i *) (src1 + x));
+		__m256i s0l = _mm256_unpacklo_epi8(s0, zero);
+		__m256i s0h = _mm256_unpackhi_epi8(s0, zero);
+		__m256i s1l = _mm256_unpacklo_epi8(s1, zero);
+		__m256i s1h = _mm256_unpackhi_epi8(s1, zero);
+		__m256i q0 = blend_div_avx2(_mm256_madd_epi16(_mm256_unpacklo_epi16(s0l, s1l), w), mul, shift);
+		__m256i q1 = blend_div_avx2(_mm256_madd_epi16(_mm256_unpackhi_epi16(s0l, s1l), w), mul, shift);
+		__m256i q2 = blend_div_avx2(_mm256_madd_epi16(_mm256_unpacklo_epi16(s0h, s1h), w), mul, shift);
+		__m256i q3 = blend_div_avx2(_mm256_madd_epi16(_mm256_unpackhi_epi16(s0h, s1h), w), mul, shift);
+		_mm256_storeu_si256((__m256i *) (dst + x),
+			_mm256_packus_epi16(_mm256_packs_epi32(q0, q1), _mm256_packs_epi32(q2, q3)));
+	}
+	blend_line_sse2(dst + x, src0 + x, src1 + x, width - x, b);
+}
+
+/* The rounding up average is corrected by the lost low bit */
+__attribute__((target("sse2")))
+static void average_line_sse2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width) {
+	const __m128i one = _mm_set1_epi8(1);
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i s0 = _mm_loadu_si128((const __m128i *) (src0 + x));
+		__m128i s1 = _mm_loadu_si128((const __m128i *) (src1 + x));
+		_mm_storeu_si128((__m128i *) (dst + x),
+			_mm_sub_epi8(_mm_avg_epu8(s0, s1),
+				_mm_and_si128(_mm_xor_si128(s0, s1), one)));
+	}
+	average_line_c(dst + x, src0 + x, src1 + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void average_line_avx2(uint8_t *dst, const uint8_t *src0, const uint8_t *src1, int width) {
+	const __m256i one = _mm256_set1_epi8(1);
+	int x;
+
+	for (x = 0; x + 32 <= width; x += 32) {
+		__m256i s0 = _mm256_loadu_si256((const __m256i *) (src0 + x));
+		__m256i s1 = _mm256_loadu_si256((const __m256i *) (src1 + x));
+		_mm256_storeu_si256((__m256i *) (dst + x),
+			_mm256_sub_epi8(_mm256_avg_epu8(s0, s1),
+				_mm256_and_si256(_mm256_xor_si256(s0, s1), one)));
+	}
+	average_line_sse2(dst + x, src0 + x, src1 + x, width - x);
+}
+
+#endif